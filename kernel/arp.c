@@ -0,0 +1,386 @@
+//
+// ARP neighbor cache and the routing table.
+//
+// net_tx_ip() looks up the next hop of a packet in the routing
+// table, then its ethernet address in the neighbor cache. An
+// unknown neighbor gets an INCOMPLETE entry, which holds a few
+// packets while ARP requests go out; the reply sends them. A
+// resolved entry is REACHABLE for a while, then STALE: it is
+// still used, but using it sends a request to the cached address
+// to confirm it. A timer ages the entries and retries requests.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "list.h"
+#include "mbuf.h"
+#include "net.h"
+#include "defs.h"
+#include "debug.h"
+
+extern uint32 local_ip;
+extern uint8 local_mac[ETHADDR_LEN];
+extern uint8 broadcast_mac[ETHADDR_LEN];
+
+#define NNEIGH           64  // entries in the neighbor cache
+#define NEIGH_HASH_SIZE  32  // a power of two
+#define NEIGH_MAXQ        4  // packets held by an unresolved entry
+
+// in timer ticks of 100ms
+#define NEIGH_TIMER       5  // how often entries are aged
+#define NEIGH_RETRANS    10  // between requests for one address
+#define NEIGH_MAX_PROBES  3  // requests before an address is unreachable
+#define NEIGH_REACHABLE_TIME 300 // a confirmed entry is trusted this long
+#define NEIGH_GC_TIME   600 // an unused stale entry is dropped after this
+
+enum neigh_state {
+  NEIGH_FREE,
+  NEIGH_INCOMPLETE,  // request sent, no reply yet
+  NEIGH_REACHABLE,   // recently confirmed
+  NEIGH_STALE,       // usable, but needs confirmation
+};
+
+struct neighbor {
+  struct neighbor *next;  // the next entry in the hash chain
+  enum neigh_state state;
+  uint32 ip;
+  uint8 mac[ETHADDR_LEN];
+  uint32 confirmed;  // ticks when the address was last confirmed
+  uint32 used;       // ticks when a packet last went to it
+  uint32 probed;     // ticks when the last request went out
+  int probes;        // requests sent while INCOMPLETE
+  struct mbufq pending;  // packets waiting for resolution
+  int npending;
+};
+
+static struct spinlock neigh_lock;
+static struct neighbor neigh_table[NNEIGH];
+static struct neighbor *neigh_hash[NEIGH_HASH_SIZE];
+
+//
+// Routes, longest prefix first. A zero gateway means the
+// destination is on the link.
+//
+struct route {
+  uint32 dst;
+  uint32 mask;
+  uint32 gw;
+};
+
+static struct route routes[] = {
+  { MAKE_IP_ADDR(10, 0, 2, 0), 0xffffff00, 0 },  // qemu's user network
+  { 0, 0, MAKE_IP_ADDR(10, 0, 2, 2) },          // everything else via slirp
+};
+
+// Returns the address to send a packet for dip to.
+static uint32
+route_nexthop(uint32 dip)
+{
+  int i;
+
+  for (i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+    if ((dip & routes[i].mask) == routes[i].dst)
+      return routes[i].gw ? routes[i].gw : dip;
+  }
+  return dip;
+}
+
+static _inline uint
+neigh_hashfn(uint32 ip)
+{
+  return (ip ^ (ip >> 16)) & (NEIGH_HASH_SIZE - 1);
+}
+
+static struct neighbor *
+neigh_lookup(uint32 ip)
+{
+  struct neighbor *n;
+
+  for (n = neigh_hash[neigh_hashfn(ip)]; n; n = n->next)
+    if (n->ip == ip)
+      return n;
+  return 0;
+}
+
+// Moves the packets waiting on n to q, to be sent or freed
+// once neigh_lock is released.
+static void
+neigh_take_pending(struct neighbor *n, struct mbufq *q)
+{
+  while (!mbufq_empty(&n->pending))
+    mbufq_pushtail(q, mbufq_pophead(&n->pending));
+  n->npending = 0;
+}
+
+static void
+neigh_free(struct neighbor *n, struct mbufq *drop)
+{
+  struct neighbor **pp;
+
+  for (pp = &neigh_hash[neigh_hashfn(n->ip)]; *pp != n; pp = &(*pp)->next)
+    ;
+  *pp = n->next;
+  neigh_take_pending(n, drop);
+  n->state = NEIGH_FREE;
+}
+
+// Allocates an entry for ip, evicting the least recently used
+// STALE entry if the cache is full.
+static struct neighbor *
+neigh_alloc(uint32 ip, struct mbufq *drop)
+{
+  struct neighbor *n, *victim = 0;
+  uint h;
+
+  for (n = neigh_table; n < neigh_table + NNEIGH; n++) {
+    if (n->state == NEIGH_FREE)
+      break;
+    if (n->state == NEIGH_STALE && (!victim || n->used < victim->used))
+      victim = n;
+  }
+  if (n == neigh_table + NNEIGH) {
+    if (!victim)
+      return 0;
+    n = victim;
+    neigh_free(n, drop);
+  }
+
+  memset(n, 0, sizeof(*n));
+  n->ip = ip;
+  n->used = ticks;
+  mbufq_init(&n->pending);
+  h = neigh_hashfn(ip);
+  n->next = neigh_hash[h];
+  neigh_hash[h] = n;
+  return n;
+}
+
+static void
+mbufq_free(struct mbufq *q)
+{
+  while (!mbufq_empty(q))
+    mbuffree(mbufq_pophead(q));
+}
+
+// sends an ARP packet; a request goes to dmac, or to everyone if
+// dmac is null.
+static int
+net_tx_arp(uint16 op, uint8 *dmac, uint32 dip)
+{
+  struct mbuf *m;
+  struct arp *arphdr;
+
+  m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
+  if (!m)
+    return -1;
+
+  // generic part of ARP header
+  arphdr = mbufputhdr(m, *arphdr);
+  arphdr->hrd = htons(ARP_HRD_ETHER);
+  arphdr->pro = htons(ETHTYPE_IP);
+  arphdr->hln = ETHADDR_LEN;
+  arphdr->pln = sizeof(uint32);
+  arphdr->op = htons(op);
+
+  // ethernet + IP part of ARP header
+  memmove(arphdr->sha, local_mac, ETHADDR_LEN);
+  arphdr->sip = htonl(local_ip);
+  if (dmac)
+    memmove(arphdr->tha, dmac, ETHADDR_LEN);
+  else
+    memset(arphdr->tha, 0, ETHADDR_LEN);
+  arphdr->tip = htonl(dip);
+
+  // header is ready, send the packet
+  net_tx_eth(m, ETHTYPE_ARP, dmac ? dmac : broadcast_mac);
+  return 0;
+}
+
+// Sends the IP packet m, whose header is in place, towards dip.
+void
+arp_output(struct mbuf *m, uint32 dip)
+{
+  struct neighbor *n;
+  struct mbufq drop;
+  uint8 mac[ETHADDR_LEN];
+  uint32 nexthop;
+  int probe = 0;
+
+  if (dip == 0xffffffff) {
+    net_tx_eth(m, ETHTYPE_IP, broadcast_mac);
+    return;
+  }
+
+  nexthop = route_nexthop(dip);
+  mbufq_init(&drop);
+
+  acquire(&neigh_lock);
+  n = neigh_lookup(nexthop);
+  if (n && n->state != NEIGH_INCOMPLETE) {
+    n->used = ticks;
+    memmove(mac, n->mac, ETHADDR_LEN);
+    /* confirm a stale address with a unicast request */
+    if (n->state == NEIGH_STALE && ticks - n->probed >= NEIGH_RETRANS) {
+      n->probed = ticks;
+      probe = 1;
+    }
+    release(&neigh_lock);
+    net_tx_eth(m, ETHTYPE_IP, mac);
+    if (probe)
+      net_tx_arp(ARP_OP_REQUEST, mac, nexthop);
+    return;
+  }
+
+  if (!n) {
+    if ((n = neigh_alloc(nexthop, &drop)) == 0) {
+      release(&neigh_lock);
+      mbuffree(m);
+      mbufq_free(&drop);
+      return;
+    }
+    n->state = NEIGH_INCOMPLETE;
+    n->probed = ticks;
+    n->probes = 1;
+    probe = 1;
+  }
+
+  /* hold the packet, dropping the oldest one if too many wait */
+  if (n->npending == NEIGH_MAXQ) {
+    mbufq_pushtail(&drop, mbufq_pophead(&n->pending));
+    n->npending--;
+  }
+  mbufq_pushtail(&n->pending, m);
+  n->npending++;
+  release(&neigh_lock);
+
+  mbufq_free(&drop);
+  if (probe)
+    net_tx_arp(ARP_OP_REQUEST, 0, nexthop);
+}
+
+// Records that ip is at mac, and sends the packets waiting for it.
+// A new entry is made only if create is set.
+static void
+neigh_update(uint32 ip, uint8 *mac, int create)
+{
+  struct neighbor *n;
+  struct mbufq q, drop;
+
+  mbufq_init(&q);
+  mbufq_init(&drop);
+
+  acquire(&neigh_lock);
+  n = neigh_lookup(ip);
+  if (!n && create)
+    n = neigh_alloc(ip, &drop);
+  if (n) {
+    memmove(n->mac, mac, ETHADDR_LEN);
+    n->state = NEIGH_REACHABLE;
+    n->confirmed = ticks;
+    neigh_take_pending(n, &q);
+  }
+  release(&neigh_lock);
+
+  mbufq_free(&drop);
+  while (!mbufq_empty(&q))
+    net_tx_eth(mbufq_pophead(&q), ETHTYPE_IP, mac);
+}
+
+// receives an ARP packet
+void
+net_rx_arp(struct mbuf *m)
+{
+  struct arp *arphdr;
+  uint8 smac[ETHADDR_LEN];
+  uint32 sip, tip;
+  int op;
+
+  arphdr = mbufpullhdr(m, *arphdr);
+  if (!arphdr)
+    goto done;
+
+  // validate the ARP header
+  if (ntohs(arphdr->hrd) != ARP_HRD_ETHER ||
+      ntohs(arphdr->pro) != ETHTYPE_IP ||
+      arphdr->hln != ETHADDR_LEN ||
+      arphdr->pln != sizeof(uint32)) {
+    goto done;
+  }
+
+  op = ntohs(arphdr->op);
+  tip = ntohl(arphdr->tip); // target IP address
+  memmove(smac, arphdr->sha, ETHADDR_LEN); // sender's ethernet address
+  sip = ntohl(arphdr->sip); // sender's IP address
+  if (sip == 0)
+    goto done;
+
+  // a sender that asks for us will talk to us, remember it;
+  // otherwise only refresh addresses that are already cached
+  neigh_update(sip, smac, tip == local_ip);
+
+  if (op == ARP_OP_REQUEST && tip == local_ip)
+    net_tx_arp(ARP_OP_REPLY, smac, sip);
+
+done:
+  mbuffree(m);
+}
+
+// Ages the cache and retries unanswered requests.
+static void *
+neigh_timer(void *arg)
+{
+  struct neighbor *n;
+  struct mbufq drop;
+  uint32 probe[NNEIGH];
+  int i, nprobe = 0;
+
+  mbufq_init(&drop);
+
+  acquire(&neigh_lock);
+  for (n = neigh_table; n < neigh_table + NNEIGH; n++) {
+    switch (n->state) {
+    case NEIGH_INCOMPLETE:
+      if (ticks - n->probed < NEIGH_RETRANS)
+        break;
+      if (n->probes >= NEIGH_MAX_PROBES) {
+        /* unreachable, drop what waits for it */
+        neigh_free(n, &drop);
+        break;
+      }
+      n->probes++;
+      n->probed = ticks;
+      probe[nprobe++] = n->ip;
+      break;
+    case NEIGH_REACHABLE:
+      if (ticks - n->confirmed >= NEIGH_REACHABLE_TIME)
+        n->state = NEIGH_STALE;
+      break;
+    case NEIGH_STALE:
+      if (ticks - n->used >= NEIGH_GC_TIME)
+        neigh_free(n, &drop);
+      break;
+    default:
+      break;
+    }
+  }
+  release(&neigh_lock);
+
+  mbufq_free(&drop);
+  for (i = 0; i < nprobe; i++)
+    net_tx_arp(ARP_OP_REQUEST, 0, probe[i]);
+
+  timer_add_in_handler(NEIGH_TIMER, neigh_timer, 0);
+  return NULL;
+}
+
+void
+arpinit(void)
+{
+  initlock(&neigh_lock, "neigh");
+  timer_add_in_handler(NEIGH_TIMER, neigh_timer, 0);
+}
@@ -21,6 +21,9 @@
 #include "riscv.h"
 #include "defs.h"
 #include "proc.h"
+#include "list.h"
+#include "poll.h"
+#include "pollwait.h"
 
 #define BACKSPACE 0x100
 #define C(x)  ((x)-'@')  // Control-x
@@ -50,6 +53,8 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+
+  struct pollhead ph;  // poll() and epoll waiters for input
 } cons;
 
 //
@@ -126,6 +131,23 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+//
+// the console is readable once a whole line has been typed.
+//
+int
+consolepoll(struct pollhead **ph)
+{
+  int mask = POLLOUT;
+
+  if(ph)
+    *ph = &cons.ph;
+  acquire(&cons.lock);
+  if(cons.r != cons.w)
+    mask |= POLLIN;
+  release(&cons.lock);
+  return mask;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -170,6 +192,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwake(&cons.ph);
       }
     }
     break;
@@ -182,6 +205,7 @@ void
 consoleinit(void)
 {
   initlock(&cons.lock, "cons");
+  pollhead_init(&cons.ph);
 
   uartinit();
 
@@ -189,4 +213,5 @@ consoleinit(void)
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
@@ -10,6 +10,13 @@ struct stat;
 struct superblock;
 struct mbuf;
 struct sock;
+struct kmem_cache;
+struct pollhead;
+struct pollwaiter;
+struct pollfd;
+struct epoll_event;
+struct eventpoll;
+struct iovec;
 
 struct sockaddr;
 
@@ -37,6 +44,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filepoll(struct file*, struct pollhead**);
 
 // fs.c
 void            fsinit(int);
@@ -65,8 +73,15 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kzalloc(void);
 void            kfree(void *);
 void            kinit(void);
+struct kmem_cache* kmem_cache_create(char *, uint, void (*)(void *));
+void*           kmem_cache_alloc(struct kmem_cache *);
+void            kmem_cache_free(struct kmem_cache *, void *);
+void*           kmalloc(uint);
+void            kmfree(void *);
+int             statskalloc(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -77,8 +92,24 @@ void            end_op(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+void            pipeinit(void);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipepoll(struct pipe*, int, struct pollhead**);
+
+// poll.c
+void            pollinit(void);
+void            pollhead_init(struct pollhead*);
+void            pollwake(struct pollhead*);
+void            pollwait_add(struct pollhead*, struct pollwaiter*, void (*)(struct pollwaiter*), void*);
+void            pollwait_del(struct pollwaiter*);
+int             pollfds(struct pollfd*, int, int);
+struct eventpoll* epollalloc(void);
+int             epollctl(struct eventpoll*, int, struct file*, struct epoll_event*);
+int             epollwait(struct eventpoll*, struct epoll_event*, int, int);
+int             epollpoll(struct eventpoll*, struct pollhead**);
+void            epollclose(struct eventpoll*);
+void            epollrelease(struct file*);
 
 // printf.c
 void            printf(char*, ...);
@@ -94,6 +125,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             kthread_create(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -178,6 +210,7 @@ void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+int             copyoutv(pagetable_t, uint64, struct iovec *, int);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
@@ -200,6 +233,12 @@ void            virtio_disk_intr(void);
 // sprintf.c
 int             snprintf(char*, int, char*, ...);
 
+// stats.c
+void            statsinit(void);
+#ifdef LAB_LOCK
+int             statslock(char*, int);
+#endif
+
 
 // pci.c
 void            pci_init();
@@ -207,39 +246,65 @@ void            pci_init();
 // e1000.c
 void            e1000_init(uint32 *);
 void            e1000_intr(void);
+void            e1000_start(void);
 int             e1000_transmit(struct mbuf*);
+int             e1000_tx_free(void);
+int             statse1000(char*, int);
+
+// arp.c
+void            arpinit(void);
+void            arp_output(struct mbuf*, uint32);
+void            net_rx_arp(struct mbuf*);
 
 // net.c
+extern uint32   net_offload;
+extern uint32   net_gso_max_segs;
+uint16          in_pseudo_sum(uint32, uint32, uint8, uint16);
+int             net_gso_room(void);
 void            net_rx(struct mbuf*);
+void            net_tx_eth(struct mbuf*, uint16, uint8*);
 void            net_tx_udp(struct mbuf*, uint32, uint16, uint16);
 void            net_tx_ip(struct mbuf *, uint8, uint32);
 
 // sysnet.c
 void            sockinit(void);
+struct sock*    sockcreate(void);
 int             sockalloc(struct file **, uint32, uint16, uint16);
+int             sockbind(struct sock *, uint16);
+int             sockconnect(struct sock *, uint32, uint16);
 void            sockclose(struct sock *);
-int             sockread(struct sock *, uint64, int);
+int             sockread(struct sock *, uint64, int, int);
 int             sockwrite(struct sock *, uint64, int);
+int             sockrecvfrom(struct sock *, uint64, int, int, uint32 *, uint16 *);
+int             socksendto(struct sock *, uint64, int, uint32, uint16);
 void            sockrecvudp(struct mbuf*, uint32, uint16, uint16);
+int             sockpoll(struct sock*, struct pollhead**);
 
 
 // socket.c
+void port_init(void);
 int alloc_port(struct file *f, uint16 p);
 int auto_alloc_port(struct file *f);
+void free_port(uint16 p);
 
 int  socket(struct file **f, int domain, int type, int protocol);
 
 struct tcp_sock *tcp_sock_alloc();
+void tcp_init(void);
 int tcp_bind(struct file *f, struct sockaddr *addr, int addrlen);
 int tcp_connect(struct file *f, struct sockaddr *addr, int addrlen, int port);
 int tcp_listen(struct file *f, int backlog);
 int tcp_read(struct file *f, uint64 addr, int n);
 int tcp_write(struct file *f, uint64 ubuf, int len);
+int tcp_sendfile(struct file *f, struct inode *ip, uint off, int count);
 int tcp_close(struct file *f);
+int tcp_setsockopt(struct file *f, int level, int optname, int val);
+int tcp_poll(struct file *f, struct pollhead **ph);
 
 // timer.c
 void timer_init();
 struct timer * timer_add(uint32 expire, void *(*handler)(void *), void *arg);
 void timer_add_in_handler(uint32 expire, void *(*handler)(void *), void *arg);
-void timer_cancel(struct timer *t);
+void timer_release(struct timer *t);
+int timer_cancel(struct timer *t);
 void timers_exe_all();
\ No newline at end of file
@@ -11,19 +11,91 @@
 #include "net.h"
 #include "debug.h"
 
-#define TX_RING_SIZE 16
+//
+// Ring sizes are chosen when the kernel is built (see
+// CONFIG_E1000_TX_RING and CONFIG_E1000_RX_RING in the Makefile),
+// rounded to a multiple of 8 descriptors, as the e1000 requires,
+// and to at most the 4096 descriptors it supports. Each receive
+// descriptor holds an mbuf from the pool all the time.
+//
+#ifndef E1000_TX_RING_SIZE
+#define E1000_TX_RING_SIZE 64
+#endif
+#ifndef E1000_RX_RING_SIZE
+#define E1000_RX_RING_SIZE 64
+#endif
+#define E1000_RING_MAX 4096
+#define RING_SIZE(n) \
+  ((n) > E1000_RING_MAX ? E1000_RING_MAX : (n) < 8 ? 8 : (n) & ~7)
+#define TX_RING_SIZE RING_SIZE(E1000_TX_RING_SIZE)
+#define RX_RING_SIZE RING_SIZE(E1000_RX_RING_SIZE)
+
+#if RX_RING_SIZE > NMBUF / 2
+#error "the e1000 rx ring would take most of the mbuf pool, raise NMBUF"
+#endif
+
 static struct tx_desc tx_ring[TX_RING_SIZE] __attribute__((aligned(16)));
 static struct mbuf *tx_mbufs[TX_RING_SIZE];
+static int tx_tail;   // next descriptor to fill, mirrors TDT
+static int tx_clean;  // oldest descriptor not yet reclaimed
+
+// The e1000 computes the checksums a packet's mbuf asks for,
+// from the offsets in the last context descriptor it was given.
+static struct tx_ctx_desc tx_ctx;  // that context
+static int tx_ctx_valid;
 
-#define RX_RING_SIZE 16
 static struct rx_desc rx_ring[RX_RING_SIZE] __attribute__((aligned(16)));
 static struct mbuf *rx_mbufs[RX_RING_SIZE];
 
+//
+// Received packets are not processed in the interrupt handler.
+// It masks the receive interrupts and wakes the rx thread, which
+// takes up to RX_BUDGET packets off the ring per pass, yielding
+// the CPU between passes, and unmasks the interrupts once the
+// ring is empty. A burst of packets thus costs one interrupt,
+// and the stack runs with interrupts enabled.
+//
+#define RX_BUDGET 16
+#define RX_INTRS (E1000_ICR_RXT0 | E1000_ICR_RXO)
+
+static int rx_scheduled;  // the rx thread has work; interrupts masked
+
+//
+// Interrupt moderation. ITR caps the interrupt rate; the rx
+// thread picks the cap from the size of each burst it drained:
+// a few packets mean interactive traffic, which wants low
+// latency, many mean bulk traffic, which wants few interrupts.
+// The delay timers, in units of 1.024us, let the e1000 batch
+// the write-backs of back-to-back frames into one interrupt.
+//
+#define ITR_LOWEST_LATENCY 70000  // interrupts per second
+#define ITR_LOW_LATENCY    20000
+#define ITR_BULK            4000
+#define ITR_VAL(rate) (1000000000 / ((rate) * 256))  // in 256ns units
+
+#define RX_DELAY      8  // RDTR: after the last frame of a burst
+#define RX_ABS_DELAY 32  // RADV: after the first one, at the latest
+#define TX_DELAY      8  // TIDV
+#define TX_ABS_DELAY 32  // TADV
+
+static int itr_rate;
+
+// Counters, reported by the statistics device.
+static struct {
+  uint64 rx_packets;
+  uint64 rx_nobuf;     // dropped, no mbuf to refill the ring
+  uint64 rx_missed;    // dropped by the e1000, the ring was full
+  uint64 rx_overruns;  // RXO interrupts
+  uint64 tx_packets;
+  uint64 tx_ring_full; // e1000_transmit() found no free descriptors
+  uint64 interrupts;
+} e1000_stats;
+
 // remember where the e1000's registers live.
 static volatile uint32 *regs;
 
-struct spinlock e1000_lock;
-struct spinlock e1000_lockrx;
+struct spinlock e1000_lock;    // protects the tx ring
+struct spinlock e1000_lockrx;  // protects rx_scheduled
 
 // called by pci_init().
 // xregs is the memory address at which the
@@ -46,16 +118,14 @@ e1000_init(uint32 *xregs)
 
   // [E1000 14.5] Transmit initialization
   memset(tx_ring, 0, sizeof(tx_ring));
-  for (i = 0; i < TX_RING_SIZE; i++) {
-    tx_ring[i].status = E1000_TXD_STAT_DD;
+  for (i = 0; i < TX_RING_SIZE; i++)
     tx_mbufs[i] = 0;
-  }
+  tx_tail = tx_clean = 0;
+  tx_ctx_valid = 0;
   regs[E1000_TDBAL] = (uint64) tx_ring;
-  if(sizeof(tx_ring) % 128 != 0)
-    panic("e1000");
-  regs[E1000_TDLEN] = sizeof(tx_ring);
+  regs[E1000_TDLEN] = TX_RING_SIZE * sizeof(struct tx_desc);
   regs[E1000_TDH] = regs[E1000_TDT] = 0;
-  
+
   // [E1000 14.4] Receive initialization
   memset(rx_ring, 0, sizeof(rx_ring));
   for (i = 0; i < RX_RING_SIZE; i++) {
@@ -65,11 +135,9 @@ e1000_init(uint32 *xregs)
     rx_ring[i].addr = (uint64) rx_mbufs[i]->head;
   }
   regs[E1000_RDBAL] = (uint64) rx_ring;
-  if(sizeof(rx_ring) % 128 != 0)
-    panic("e1000");
   regs[E1000_RDH] = 0;
   regs[E1000_RDT] = RX_RING_SIZE - 1;
-  regs[E1000_RDLEN] = sizeof(rx_ring);
+  regs[E1000_RDLEN] = RX_RING_SIZE * sizeof(struct rx_desc);
 
   // filter by qemu's MAC address, 52:54:00:12:34:56
   regs[E1000_RA] = 0x12005452;
@@ -90,83 +158,370 @@ e1000_init(uint32 *xregs)
     E1000_RCTL_BAM |                 // enable broadcast
     E1000_RCTL_SZ_2048 |             // 2048-byte rx buffers
     E1000_RCTL_SECRC;                // strip CRC
-  
-  // ask e1000 for receive interrupts.
-  regs[E1000_RDTR] = 0; // interrupt after every received packet (no timer)
-  regs[E1000_RADV] = 0; // interrupt after every packet (no timer)
-  regs[E1000_IMS] = (1 << 7); // RXDW -- Receiver Descriptor Write Back
+
+  // check IP, TCP and UDP checksums; the transmitter
+  // inserts them when told to by a context descriptor.
+  regs[E1000_RXCSUM] = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
+  net_offload = NET_OFFLOAD_CSUM;
+#ifdef E1000_TSO
+  // otherwise net_gso_segment() cuts super-segments in software
+  net_offload |= NET_OFFLOAD_TSO;
+#endif
+
+  // a super-segment takes a descriptor per segment, plus one for
+  // the headers and one for the context, and leaves room for more.
+  net_gso_max_segs = TX_RING_SIZE / 2 - 2;
+  if (net_gso_max_segs < 1)
+    net_gso_max_segs = 1;
+
+  // ask e1000 for moderated receive and transmit interrupts.
+  regs[E1000_RDTR] = RX_DELAY;
+  regs[E1000_RADV] = RX_ABS_DELAY;
+  regs[E1000_TIDV] = TX_DELAY;
+  regs[E1000_TADV] = TX_ABS_DELAY;
+  itr_rate = ITR_LOW_LATENCY;
+  regs[E1000_ITR] = ITR_VAL(itr_rate);
+  regs[E1000_IMS] = RX_INTRS | E1000_ICR_TXDW;
+}
+
+// the ring must keep one free slot, or TDT == TDH would
+// look like an empty ring to the e1000.
+#define TX_FREE() ((tx_clean + TX_RING_SIZE - tx_tail - 1) % TX_RING_SIZE)
+
+// Frees the mbufs of descriptors the e1000 has sent.
+// Caller holds e1000_lock.
+static void
+e1000_txclean(void)
+{
+  while (tx_clean != tx_tail && (tx_ring[tx_clean].status & E1000_TXD_STAT_DD)) {
+    if (tx_mbufs[tx_clean]) {
+      mbuffree(tx_mbufs[tx_clean]);
+      tx_mbufs[tx_clean] = 0;
+    }
+    tx_clean = (tx_clean + 1) % TX_RING_SIZE;
+  }
+}
+
+// Returns the number of free transmit descriptors, after
+// reclaiming those the e1000 has sent.
+int
+e1000_tx_free(void)
+{
+  int n;
+
+  acquire(&e1000_lock);
+  e1000_txclean();
+  n = TX_FREE();
+  release(&e1000_lock);
+  return n;
+}
+
+// Fills in c with the checksum offsets of the frame m, which
+// starts with the ethernet header. For a TCP super-segment, c
+// also tells the e1000 how to cut it into segments: the headers
+// in the first mbuf are copied in front of each gso_size bytes
+// of the payload, with the lengths, sequence number and
+// checksums fixed up.
+static void
+e1000_csum_ctx(struct mbuf *m, struct tx_ctx_desc *c)
+{
+  struct ip *iphdr = (struct ip *)(m->head + sizeof(struct eth));
+  int ipcss = sizeof(struct eth);
+  int tucss = ipcss + (iphdr->ip_vhl & 0xf) * 4;
+  uint32 tucmd = E1000_TXD_CMD_IP, paylen = 0;
+
+  memset(c, 0, sizeof(*c));
+  c->ipcss = ipcss;
+  c->ipcso = ipcss + 10;  // ip_sum
+  c->ipcse = tucss - 1;
+  c->tucss = tucss;
+  if (m->csum & MBUF_CSUM_TCP) {
+    c->tucso = tucss + 16;  // TCP checksum
+    tucmd |= E1000_TXD_CMD_TCP;
+  } else {
+    c->tucso = tucss + 6;   // UDP checksum
+  }
+  c->tucse = 0;
+  if (m->gso_size) {
+    tucmd |= E1000_TXD_CMD_TSE;
+    c->hdr_len = m->len;
+    c->mss = m->gso_size;
+    paylen = mbuf_pktlen(m) - m->len;
+  }
+  c->cmd_and_length = E1000_TXD_DTYP_C | paylen |
+    ((tucmd | E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS) << E1000_TXD_CMD_SHIFT);
 }
 
 int
 e1000_transmit(struct mbuf *m)
 {
-  // the mbuf contains an ethernet frame; program it into
-  // the TX descriptor ring so that the e1000 sends it. Stash
-  // a pointer so that it can be freed after sending.
+  // the mbuf chain contains an ethernet frame; program one
+  // TX descriptor per mbuf, with EOP on the last, so that the
+  // e1000 gathers and sends it. Stash a pointer to the chain
+  // at the last descriptor so that it can be freed after sending.
+  // A frame whose checksums the e1000 is to fill in, or which it
+  // is to segment, uses data descriptors instead, preceded by a
+  // context descriptor if the offsets differ from the previous
+  // such frame's.
   //
-  e1000dbg("[e1000] %d len data transmit\n", m->len);
+  struct tx_ctx_desc ctx;
+  struct tx_data_desc *d;
+  struct mbuf *f;
+  int i, last, n = 0, newctx = 0;
+  uint8 popts = 0;
+  uint32 cmd, dcmd;
+
+  for (f = m; f; f = f->frag)
+    n++;
+
+  if (m->csum & MBUF_CSUM_IP)
+    popts |= E1000_TXD_POPTS_IXSM;
+  if (m->csum & (MBUF_CSUM_TCP | MBUF_CSUM_UDP))
+    popts |= E1000_TXD_POPTS_TXSM;
+  dcmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS;
+  if (m->gso_size)
+    dcmd |= E1000_TXD_CMD_TSE;
+
+  e1000dbg("[e1000] %d len data transmit in %d descriptors\n", mbuf_pktlen(m), n);
 
   acquire(&e1000_lock);
 
-  int tail = regs[E1000_TDT];
-  if(!(tx_ring[tail].status & E1000_TXD_STAT_DD)){
+  if (popts) {
+    e1000_csum_ctx(m, &ctx);
+    if (!tx_ctx_valid || memcmp(&ctx, &tx_ctx, sizeof(ctx)) != 0) {
+      newctx = 1;
+      n++;
+    }
+  }
+
+  // Descriptors are normally reclaimed on the TXDW interrupt;
+  // if the ring looks full, reclaim what was sent since.
+  if(n > TX_FREE())
+    e1000_txclean();
+  if(n > TX_FREE()){
+    e1000_stats.tx_ring_full++;
     release(&e1000_lock);
     return -1;
   }
-  
-  if(tx_mbufs[tail])
-    mbuffree(tx_mbufs[tail]);
-  
-  memset(&tx_ring[tail], 0, sizeof(struct tx_desc));
-  tx_ring[tail].cmd = (E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS);
-  tx_ring[tail].addr = (uint64)m->head;
-  tx_ring[tail].length = m->len;
-  tx_mbufs[tail] = m;
-
-  regs[E1000_TDT] = (tail + 1) % TX_RING_SIZE;
-  
+
+  i = tx_tail;
+  if(newctx){
+    memmove(&tx_ring[i], &ctx, sizeof(ctx));
+    tx_ctx = ctx;
+    tx_ctx_valid = 1;
+    i = (i + 1) % TX_RING_SIZE;
+  }
+
+  last = i;
+  for(f = m; f; f = f->frag, i = (i + 1) % TX_RING_SIZE){
+    memset(&tx_ring[i], 0, sizeof(struct tx_desc));
+    if(popts){
+      d = (struct tx_data_desc *)&tx_ring[i];
+      d->addr = (uint64)f->head;
+      d->cmd_and_length = f->len | E1000_TXD_DTYP_D | (dcmd << E1000_TXD_CMD_SHIFT);
+      d->popts = popts;
+    } else {
+      tx_ring[i].cmd = E1000_TXD_CMD_RS;
+      tx_ring[i].addr = (uint64)f->head;
+      tx_ring[i].length = f->len;
+    }
+    last = i;
+  }
+  // only the end of a frame starts the delay timer
+  cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IDE;
+  if(popts)
+    ((struct tx_data_desc *)&tx_ring[last])->cmd_and_length |= cmd << E1000_TXD_CMD_SHIFT;
+  else
+    tx_ring[last].cmd |= cmd;
+  tx_mbufs[last] = m;
+  tx_tail = (last + 1) % TX_RING_SIZE;
+  e1000_stats.tx_packets++;
+
+  __sync_synchronize();
+  regs[E1000_TDT] = tx_tail;
+
   release(&e1000_lock);
- 
+
   return 0;
 }
 
-static void
-e1000_recv(void)
+// Translates what the e1000 found checking the checksums of a
+// received packet into MBUF_CSUM_* flags.
+static int
+e1000_rx_csum(struct rx_desc *desc)
 {
-  // Check for packets that have arrived from the e1000
-  // Create and deliver an mbuf for each packet (using net_rx()).
-  //
-  acquire(&e1000_lockrx);
+  int csum = 0;
+
+  if (desc->status & E1000_RXD_STAT_IXSM)
+    return 0;
+  if (desc->status & E1000_RXD_STAT_IPCS)
+    csum |= (desc->errors & E1000_RXD_ERR_IPE) ? MBUF_CSUM_IP_BAD : MBUF_CSUM_IP_OK;
+  if (desc->status & E1000_RXD_STAT_TCPCS)
+    csum |= (desc->errors & E1000_RXD_ERR_TCPE) ? MBUF_CSUM_L4_BAD : MBUF_CSUM_L4_OK;
+  return csum;
+}
+
+// Delivers up to budget packets that have arrived from the e1000
+// to net_rx(), and returns how many it took off the ring. Only the
+// rx thread calls it, so the ring needs no lock.
+static int
+e1000_recv(int budget)
+{
+  int n = 0;
 
   int i = (regs[E1000_RDT] + 1) % RX_RING_SIZE;
-  while(rx_ring[i].status & E1000_RXD_STAT_DD){
-    rx_mbufs[i]->len = rx_ring[i].length;
+  while(n < budget && (rx_ring[i].status & E1000_RXD_STAT_DD)){
     struct mbuf *rb = rx_mbufs[i];
+    struct mbuf *nb = mbufalloc(0);
 
-    rx_mbufs[i] = mbufalloc(0);
-    if (!rx_mbufs[i])
-      panic("e1000");
+    // if the pool is empty, drop the packet and reuse its buffer
+    if (nb) {
+      rb->len = rx_ring[i].length;
+      rb->csum = e1000_rx_csum(&rx_ring[i]);
+      rx_mbufs[i] = nb;
+    } else {
+      rb = 0;
+      e1000_stats.rx_nobuf++;
+    }
     rx_ring[i].addr = (uint64) rx_mbufs[i]->head;
     rx_ring[i].status = 0;
     regs[E1000_RDT] = i;
+    n++;
 
-    e1000dbg("[e1000] %d len data received\n", rb->len);
-
-    net_rx(rb);
+    if (rb) {
+      e1000dbg("[e1000] %d len data received\n", rb->len);
+      e1000_stats.rx_packets++;
+      net_rx(rb);
+    }
 
     i = (regs[E1000_RDT] + 1) % RX_RING_SIZE;
   }
 
-  release(&e1000_lockrx);
+  return n;
+}
+
+static int
+e1000_rx_pending(void)
+{
+  return rx_ring[(regs[E1000_RDT] + 1) % RX_RING_SIZE].status & E1000_RXD_STAT_DD;
+}
+
+// Picks the interrupt rate cap for the next burst from the
+// number of packets in the last one.
+static void
+e1000_update_itr(int burst)
+{
+  int rate;
+
+  if (burst <= 2)
+    rate = ITR_LOWEST_LATENCY;
+  else if (burst <= RX_BUDGET)
+    rate = ITR_LOW_LATENCY;
+  else
+    rate = ITR_BULK;
+  if (rate != itr_rate) {
+    itr_rate = rate;
+    regs[E1000_ITR] = ITR_VAL(rate);
+  }
+}
+
+static void
+e1000_rx_thread(void)
+{
+  int n, burst = 0;
+
+  for(;;){
+    acquire(&e1000_lockrx);
+    while(!rx_scheduled)
+      sleep(&rx_scheduled, &e1000_lockrx);
+    release(&e1000_lockrx);
+
+    n = e1000_recv(RX_BUDGET);
+    burst += n;
+    if(n == RX_BUDGET){
+      // there may be more; let others run first
+      yield();
+      continue;
+    }
+
+    e1000_update_itr(burst);
+    burst = 0;
+
+    // the ring looks empty; unmask, then look again, since the
+    // interrupt handler may have consumed the cause of a packet
+    // that arrived in between.
+    acquire(&e1000_lockrx);
+    rx_scheduled = 0;
+    regs[E1000_IMS] = RX_INTRS;
+    __sync_synchronize();
+    if(e1000_rx_pending()){
+      regs[E1000_IMC] = RX_INTRS;
+      rx_scheduled = 1;
+    }
+    release(&e1000_lockrx);
+  }
+}
+
+// called by main() once processes can be created.
+void
+e1000_start(void)
+{
+  if(!regs)
+    return;
+  if(kthread_create("e1000_rx", e1000_rx_thread) < 0)
+    panic("e1000_start");
 }
 
 void
 e1000_intr(void)
 {
-  // tell the e1000 we've seen this interrupt;
-  // without this the e1000 won't raise any
-  // further interrupts.
-  regs[E1000_ICR] = 0xffffffff;
+  uint32 icr;
+
+  // reading ICR tells the e1000 we've seen this interrupt;
+  // without this the e1000 won't raise any further interrupts.
+  icr = regs[E1000_ICR];
+  regs[E1000_ICR] = icr;
+  e1000_stats.interrupts++;
+
+  if(icr & E1000_ICR_TXDW){
+    acquire(&e1000_lock);
+    e1000_txclean();
+    release(&e1000_lock);
+  }
+
+  if(icr & RX_INTRS){
+    // mask further receive interrupts until the rx thread has
+    // emptied the ring.
+    regs[E1000_IMC] = RX_INTRS;
+
+    acquire(&e1000_lockrx);
+    if(icr & E1000_ICR_RXO)
+      e1000_stats.rx_overruns++;
+    rx_scheduled = 1;
+    wakeup(&rx_scheduled);
+    release(&e1000_lockrx);
+  }
+}
+
+// Reports the driver's counters for the statistics device.
+int
+statse1000(char *buf, int sz)
+{
+  if(!regs)
+    return 0;
+
+  // MPC clears when read
+  acquire(&e1000_lockrx);
+  e1000_stats.rx_missed += regs[E1000_MPC];
+  release(&e1000_lockrx);
 
-  e1000_recv();
+  return snprintf(buf, sz,
+    "--- e1000\n"
+    "rx ring %d packets %d nobuf %d missed %d overruns %d\n"
+    "tx ring %d packets %d ring full %d\n"
+    "interrupts %d itr %d/s\n",
+    RX_RING_SIZE, (int)e1000_stats.rx_packets, (int)e1000_stats.rx_nobuf,
+    (int)e1000_stats.rx_missed, (int)e1000_stats.rx_overruns,
+    TX_RING_SIZE, (int)e1000_stats.tx_packets, (int)e1000_stats.tx_ring_full,
+    (int)e1000_stats.interrupts, itr_rate);
 }
@@ -6,7 +6,9 @@
 /* Registers */
 #define E1000_CTL      (0x00000/4)  /* Device Control Register - RW */
 #define E1000_ICR      (0x000C0/4)  /* Interrupt Cause Read - R */
+#define E1000_ITR      (0x000C4/4)  /* Interrupt Throttling Rate - RW */
 #define E1000_IMS      (0x000D0/4)  /* Interrupt Mask Set - RW */
+#define E1000_IMC      (0x000D8/4)  /* Interrupt Mask Clear - WO */
 #define E1000_RCTL     (0x00100/4)  /* RX Control - RW */
 #define E1000_TCTL     (0x00400/4)  /* TX Control - RW */
 #define E1000_TIPG     (0x00410/4)  /* TX Inter-packet gap -RW */
@@ -21,6 +23,10 @@
 #define E1000_TDLEN    (0x03808/4)  /* TX Descriptor Length - RW */
 #define E1000_TDH      (0x03810/4)  /* TX Descriptor Head - RW */
 #define E1000_TDT      (0x03818/4)  /* TX Descripotr Tail - RW */
+#define E1000_TIDV     (0x03820/4)  /* TX Interrupt Delay Value - RW */
+#define E1000_TADV     (0x0382C/4)  /* TX Interrupt Absolute Delay Val - RW */
+#define E1000_MPC      (0x04010/4)  /* Missed Packet Count - R/clr */
+#define E1000_RXCSUM   (0x05000/4)  /* RX Checksum Control - RW */
 #define E1000_MTA      (0x05200/4)  /* Multicast Table Array - RW Array */
 #define E1000_RA       (0x05400/4)  /* Receive Address - RW Array */
 
@@ -30,6 +36,12 @@
 #define E1000_CTL_FRCDPLX 0x00001000    /* force duplex */
 #define E1000_CTL_RST     0x00400000    /* full reset */
 
+/* Interrupt Cause bits, the same in ICR, IMS and IMC */
+#define E1000_ICR_TXDW    0x00000001    /* tx desc written back */
+#define E1000_ICR_RXDMT0  0x00000010    /* rx desc min. threshold */
+#define E1000_ICR_RXO     0x00000040    /* rx overrun */
+#define E1000_ICR_RXT0    0x00000080    /* rx timer intr (descriptor write back) */
+
 /* Transmit Control */
 #define E1000_TCTL_RST    0x00000001    /* software reset */
 #define E1000_TCTL_EN     0x00000002    /* enable tx */
@@ -87,11 +99,32 @@
 #define E1000_RCTL_FLXBUF_MASK    0x78000000    /* Flexible buffer size */
 #define E1000_RCTL_FLXBUF_SHIFT   27            /* Flexible buffer shift */
 
+/* Receive Checksum Control */
+#define E1000_RXCSUM_IPOFL        0x00000100    /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL        0x00000200    /* TCP / UDP checksum offload */
+
 #define DATA_MAX 1518
 
 /* Transmit Descriptor command definitions [E1000 3.3.3.1] */
 #define E1000_TXD_CMD_EOP    0x01 /* End of Packet */
 #define E1000_TXD_CMD_RS     0x08 /* Report Status */
+#define E1000_TXD_CMD_DEXT   0x20 /* Descriptor extension (0 = legacy) */
+#define E1000_TXD_CMD_IDE    0x80 /* Enable Tidv register */
+
+/* Context descriptor TUCMD [E1000 3.3.6], in the same byte as the
+   command of a data descriptor */
+#define E1000_TXD_CMD_TCP    0x01 /* TCP packet */
+#define E1000_TXD_CMD_IP     0x02 /* IP packet */
+#define E1000_TXD_CMD_TSE    0x04 /* TCP Seg enable, also in data descriptors */
+
+/* Descriptor types, in cmd_and_length */
+#define E1000_TXD_DTYP_C     0x00000000 /* Context Descriptor */
+#define E1000_TXD_DTYP_D     0x00100000 /* Data Descriptor */
+#define E1000_TXD_CMD_SHIFT  24
+
+/* Data descriptor packet options [E1000 3.3.7.1] */
+#define E1000_TXD_POPTS_IXSM 0x01 /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 0x02 /* Insert TCP/UDP checksum */
 
 /* Transmit Descriptor status definitions [E1000 3.3.3.2] */
 #define E1000_TXD_STAT_DD    0x00000001 /* Descriptor Done */
@@ -108,9 +141,40 @@ struct tx_desc
   uint16 special;
 };
 
+// [E1000 3.3.6] TCP/IP context descriptor, which tells the e1000
+// where the checksums of the packets that follow are.
+struct tx_ctx_desc
+{
+  uint8 ipcss;       /* IP checksum start */
+  uint8 ipcso;       /* IP checksum offset */
+  uint16 ipcse;      /* IP checksum end */
+  uint8 tucss;       /* TCP/UDP checksum start */
+  uint8 tucso;       /* TCP/UDP checksum offset */
+  uint16 tucse;      /* TCP/UDP checksum end, 0 for the end of packet */
+  uint32 cmd_and_length;
+  uint8 status;
+  uint8 hdr_len;
+  uint16 mss;
+};
+
+// [E1000 3.3.7] TCP/IP data descriptor
+struct tx_data_desc
+{
+  uint64 addr;
+  uint32 cmd_and_length;
+  uint8 status;
+  uint8 popts;
+  uint16 special;
+};
+
 /* Receive Descriptor bit definitions [E1000 3.2.3.1] */
 #define E1000_RXD_STAT_DD       0x01    /* Descriptor Done */
 #define E1000_RXD_STAT_EOP      0x02    /* End of Packet */
+#define E1000_RXD_STAT_IXSM     0x04    /* Ignore checksum */
+#define E1000_RXD_STAT_TCPCS    0x20    /* TCP/UDP checksum calculated */
+#define E1000_RXD_STAT_IPCS     0x40    /* IP checksum calculated */
+#define E1000_RXD_ERR_TCPE      0x20    /* TCP/UDP checksum error */
+#define E1000_RXD_ERR_IPE       0x40    /* IP checksum error */
 
 // [E1000 3.2.3]
 struct rx_desc
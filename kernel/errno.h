@@ -0,0 +1,10 @@
+// Error codes, returned negated by the system calls that can
+// tell the caller why they failed. Others just return -1.
+
+#define EAGAIN       11   // non-blocking file is not ready
+#define ECONNRESET   104  // connection reset by the peer
+#define EISCONN      106  // socket is already connected
+#define ETIMEDOUT    110  // connection timed out
+#define ECONNREFUSED 111  // connection refused by the peer
+#define EALREADY     114  // connect() is already in progress
+#define EINPROGRESS  115  // non-blocking connect() has started
@@ -12,6 +12,7 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "poll.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -35,6 +36,7 @@ filealloc(void)
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     if(f->ref == 0){
       f->ref = 1;
+      f->nonblock = 0;
       release(&ftable.lock);
       return f;
     }
@@ -68,6 +70,8 @@ fileclose(struct file *f)
     release(&ftable.lock);
     return;
   }
+  if(f->epitems)
+    epollrelease(f);
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
@@ -83,6 +87,35 @@ fileclose(struct file *f)
     sockclose(ff.sock);
   } else if (ff.type == FD_SOCK_TCP){
     tcp_close(&ff);
+  } else if(ff.type == FD_EPOLL){
+    epollclose(ff.ep);
+  }
+}
+
+// Returns the POLL* events ready on file f. If ph is not null,
+// also returns in *ph the pollhead woken when they change, or
+// null if f is always ready.
+int
+filepoll(struct file *f, struct pollhead **ph)
+{
+  if(ph)
+    *ph = 0;
+
+  switch(f->type){
+  case FD_PIPE:
+    return pipepoll(f->pipe, f->writable, ph);
+  case FD_DEVICE:
+    if(f->major >= 0 && f->major < NDEV && devsw[f->major].poll)
+      return devsw[f->major].poll(ph);
+    return POLLIN | POLLOUT;
+  case FD_SOCK_UDP:
+    return sockpoll(f->sock, ph);
+  case FD_SOCK_TCP:
+    return tcp_poll(f, ph);
+  case FD_EPOLL:
+    return epollpoll(f->ep, ph);
+  default:
+    return POLLIN | POLLOUT;
   }
 }
 
@@ -127,7 +160,7 @@ fileread(struct file *f, uint64 addr, int n)
       f->off += r;
     iunlock(f->ip);
   } else if(f->type == FD_SOCK_UDP){
-    r = sockread(f->sock, addr, n);
+    r = sockread(f->sock, addr, n, f->nonblock);
   } else if (f->type == FD_SOCK_TCP) {
     r = tcp_read(f, addr, n);
   }
@@ -1,12 +1,15 @@
 struct file {
-  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_SOCK_UDP, FD_SOCK_TCP } type;
+  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_SOCK_UDP, FD_SOCK_TCP, FD_EPOLL } type;
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock;     // O_NONBLOCK: fail with EAGAIN instead of sleeping
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   struct sock *sock; // FD_SOCK_UDP
   struct tcp_sock *tcpsock; // FD_SOCK_TCP
+  struct eventpoll *ep;     // FD_EPOLL
+  struct epitem *epitems;   // epoll sets watching this file
   uint off;          // FD_INODE
   short major;       // FD_DEVICE
 };
@@ -31,10 +34,13 @@ struct inode {
   uint addrs[NDIRECT+1];
 };
 
+struct pollhead;
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(struct pollhead**);  // ready events; always ready if null
 };
 
 extern struct devsw devsw[];
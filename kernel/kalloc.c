@@ -1,6 +1,10 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+// Each CPU keeps its own list of free pages and moves
+// them to and from the global pool in batches.
+// Small kernel objects come from object caches built
+// on top of the page allocator; see kmem_cache_create().
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +12,7 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "list.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -18,16 +23,59 @@ struct run {
   struct run *next;
 };
 
+#define PCP_HIGH  64  // drain a CPU's list once it holds more pages
+#define PCP_BATCH 32  // pages moved to or from the global pool at once
+
+// The global pool.
 struct {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
 } kmem;
 
+// Per-CPU free lists. The lock is only contended when
+// another CPU, out of pages, steals from this one.
+struct kmem_cpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint hit;     // kalloc() served from this list
+  uint miss;    // this list was empty
+  uint steal;   // pages taken from other CPUs
+} kmem_cpus[NCPU];
+
+static void kmem_drain(struct kmem_cpu *kc);
+static void kmalloc_init(void);
+
+#ifdef KALLOC_DEBUG
+// Free pages are filled with JUNK_FREE and checked for it on
+// allocation, to catch writes through dangling references;
+// allocated pages are filled with JUNK_ALLOC to catch readers
+// of uninitialized memory. Build with CONFIG_KALLOC_DEBUG=1.
+#define JUNK_FREE  1
+#define JUNK_ALLOC 5
+
+static void
+kalloc_check(struct run *r)
+{
+  char *p;
+
+  for(p = (char*)(r + 1); p < (char*)r + PGSIZE; p++)
+    if(*p != JUNK_FREE)
+      panic("kalloc: use after free");
+}
+#endif
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem_cpus[i].lock, "kmem_cpu");
   freerange(end, (void*)PHYSTOP);
+  kmalloc_init();
 }
 
 void
@@ -46,37 +94,527 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
+  struct kmem_cpu *kc;
   struct run *r;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  memset(pa, JUNK_FREE, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
+  push_off();
+  kc = &kmem_cpus[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  if(++kc->nfree > PCP_HIGH)
+    kmem_drain(kc);
+  release(&kc->lock);
+  pop_off();
+}
+
+// Unlinks up to n pages from the front of *list and returns
+// them as a chain; *got is set to the number taken.
+static struct run *
+take_pages(struct run **list, int n, int *got)
+{
+  struct run *first = *list, *last = 0;
+  int i;
+
+  for(i = 0; i < n && *list; i++){
+    last = *list;
+    *list = last->next;
+  }
+  if(last)
+    last->next = 0;
+  *got = i;
+  return i ? first : 0;
+}
+
+// Links a chain of pages in front of *list.
+static void
+put_pages(struct run **list, struct run *chain)
+{
+  struct run *last;
+
+  for(last = chain; last->next; last = last->next)
+    ;
+  last->next = *list;
+  *list = chain;
+}
+
+// Moves a batch of pages from the global pool to kc.
+// Called with kc->lock held.
+static void
+kmem_refill(struct kmem_cpu *kc)
+{
+  struct run *r;
+  int n;
+
+  acquire(&kmem.lock);
+  r = take_pages(&kmem.freelist, PCP_BATCH, &n);
+  kmem.nfree -= n;
+  release(&kmem.lock);
+
+  if(!r)
+    return;
+  put_pages(&kc->freelist, r);
+  kc->nfree += n;
+}
+
+// Moves a batch of pages from kc to the global pool.
+// Called with kc->lock held.
+static void
+kmem_drain(struct kmem_cpu *kc)
+{
+  struct run *r;
+  int n;
+
+  r = take_pages(&kc->freelist, PCP_BATCH, &n);
+  kc->nfree -= n;
+
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  put_pages(&kmem.freelist, r);
+  kmem.nfree += n;
   release(&kmem.lock);
 }
 
+// Takes up to half of another CPU's pages, when both kc and
+// the global pool are empty. Returns one page and leaves the
+// rest on kc. Called without kc->lock held, so that two CPUs
+// stealing from each other cannot deadlock.
+static struct run *
+kmem_steal(struct kmem_cpu *kc)
+{
+  struct kmem_cpu *victim;
+  struct run *r = 0;
+  int i, n = 0;
+
+  for(i = 0; i < NCPU && !r; i++){
+    victim = &kmem_cpus[i];
+    if(victim == kc)
+      continue;
+    acquire(&victim->lock);
+    r = take_pages(&victim->freelist, (victim->nfree + 1) / 2, &n);
+    victim->nfree -= n;
+    release(&victim->lock);
+  }
+  if(!r)
+    return 0;
+
+  acquire(&kc->lock);
+  kc->steal += n;
+  if(r->next){
+    put_pages(&kc->freelist, r->next);
+    kc->nfree += n - 1;
+  }
+  release(&kc->lock);
+  return r;
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
 {
+  struct kmem_cpu *kc;
   struct run *r;
 
+  push_off();
+  kc = &kmem_cpus[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist){
+    kc->hit++;
+  } else {
+    kc->miss++;
+    kmem_refill(kc);
+  }
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+  if(!r)
+    r = kmem_steal(kc);
+  pop_off();
+
+#ifdef KALLOC_DEBUG
+  if(r){
+    kalloc_check(r);
+    memset((char*)r, JUNK_ALLOC, PGSIZE); // fill with junk
+  }
+#endif
+  return (void*)r;
+}
+
+// Allocate one zeroed 4096-byte page of physical memory.
+void *
+kzalloc(void)
+{
+  void *pa = kalloc();
+
+  if(pa)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Reports the page allocator counters for the statistics device.
+int
+statskalloc(char *buf, int sz)
+{
+  struct kmem_cpu *kc;
+  int i, n;
+
+  n = snprintf(buf, sz, "--- kalloc per-CPU free lists\n");
+  for(i = 0; i < NCPU; i++){
+    kc = &kmem_cpus[i];
+    acquire(&kc->lock);
+    n += snprintf(buf+n, sz-n, "cpu %d: free %d hit %d miss %d steal %d\n",
+                  i, kc->nfree, kc->hit, kc->miss, kc->steal);
+    release(&kc->lock);
+  }
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  n += snprintf(buf+n, sz-n, "global: free %d\n", kmem.nfree);
   release(&kmem.lock);
+  return n;
+}
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+//
+// Object caches. A cache hands out objects of one size, carved
+// from slabs of a single page. Small objects share the page with
+// its struct slab header, so that the slab of an object is found by
+// rounding its address down to a page. Objects of OFFSLAB_MIN bytes
+// or more would lose one object per page to the header; their
+// headers come from slab_cache instead, and are found through a
+// hash of the page address.
+//
+// A free object holds its freelist link in its first word, as free
+// pages do. A cache with a constructor keeps the link just past the
+// object instead, so an object keeps the state its constructor gave
+// it while it is cached; callers must free objects in that state.
+//
+// Each CPU keeps a magazine of free objects per cache, so most
+// allocations and frees only turn interrupts off and take no lock.
+// A magazine is refilled from, or drained to, the slabs in batches
+// of MAG_BATCH under the cache lock.
+//
+
+#define NCACHE     24
+#define MAG_SIZE   16   // objects in a per-CPU magazine
+#define MAG_BATCH  (MAG_SIZE / 2)
+#define SLAB_HDR   ((sizeof(struct slab) + 7) & ~7)
+#define OFFSLAB_MIN (PGSIZE / 8)
+#define NSLABHASH  64
+
+struct slab {
+  struct kmem_cache *cache;
+  struct list_head list;  // on cache->slabs while it has free objects
+  struct list_head hash;  // on slab_hash, for an off-page header
+  char *page;             // the page the objects are carved from
+  void *free;             // first free object
+  int inuse;              // objects handed out
+};
+
+struct magazine {
+  int n;
+  void *objs[MAG_SIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint objsize;           // size asked for, rounded up to 8 bytes
+  uint size;              // stride of objects in a slab
+  uint link;              // offset of the freelist link in a free object
+  uint first;             // offset of the first object in the page
+  int offslab;            // struct slab is not on the page
+  uint perslab;
+  void (*ctor)(void *);
+  struct spinlock lock;   // protects slabs and nempty
+  struct list_head slabs; // slabs with free objects
+  int nempty;             // slabs on that list with nothing in use
+  struct magazine mag[NCPU];
+};
+
+static struct kmem_cache caches[NCACHE];
+static int ncaches;
+
+static struct kmem_cache *slab_cache; // off-page slab headers
+static struct spinlock slab_hash_lock;
+static struct list_head slab_hash[NSLABHASH];
+
+static _inline void **
+obj_link(struct kmem_cache *c, void *obj)
+{
+  return (void **)((char *)obj + c->link);
+}
+
+static _inline struct list_head *
+slab_hashfn(uint64 page)
+{
+  return &slab_hash[(page >> PGSHIFT) % NSLABHASH];
+}
+
+// Returns the off-page header of the slab holding obj, or 0 if
+// the page carries its own header.
+static struct slab *
+offslab_find(void *obj)
+{
+  uint64 page = PGROUNDDOWN((uint64)obj);
+  struct list_head *h = slab_hashfn(page);
+  struct slab *s;
+
+  acquire(&slab_hash_lock);
+  list_for_each_entry(s, h, hash) {
+    if ((uint64)s->page == page) {
+      release(&slab_hash_lock);
+      return s;
+    }
+  }
+  release(&slab_hash_lock);
+  return 0;
+}
+
+static _inline struct slab *
+obj_slab(struct kmem_cache *c, void *obj)
+{
+  if (c->offslab)
+    return offslab_find(obj);
+  return (struct slab *)PGROUNDDOWN((uint64)obj);
+}
+
+// Creates a cache of objects of the given size. ctor, if not
+// null, is run once on each object when its slab is allocated.
+// Caches are never destroyed.
+struct kmem_cache *
+kmem_cache_create(char *name, uint size, void (*ctor)(void *))
+{
+  struct kmem_cache *c;
+  int i;
+
+  i = __sync_fetch_and_add(&ncaches, 1);
+  if (i >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+
+  c = &caches[i];
+  c->name = name;
+  c->objsize = (size + 7) & ~7;
+  c->size = c->objsize;
+  c->link = 0;
+  if (ctor) {
+    c->link = c->objsize;
+    c->size += sizeof(void *);
+  }
+  c->offslab = c->size >= OFFSLAB_MIN && slab_cache;
+  c->first = c->offslab ? 0 : SLAB_HDR;
+  c->perslab = (PGSIZE - c->first) / c->size;
+  if (c->perslab == 0)
+    panic("kmem_cache_create: object too big");
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  list_init(&c->slabs);
+  c->nempty = 0;
+  return c;
+}
+
+// Allocates a page and carves it into objects.
+// Called with c->lock held.
+static struct slab *
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *page, *obj;
+  int i;
+
+  if ((page = kalloc()) == 0)
+    return 0;
+  if (c->offslab) {
+    if ((s = kmem_cache_alloc(slab_cache)) == 0) {
+      kfree(page);
+      return 0;
+    }
+    acquire(&slab_hash_lock);
+    list_add(&s->hash, slab_hashfn((uint64)page));
+    release(&slab_hash_lock);
+  } else {
+    s = (struct slab *)page;
+  }
+  s->cache = c;
+  s->page = page;
+  s->free = 0;
+  s->inuse = 0;
+  obj = page + c->first + (c->perslab - 1) * c->size;
+  for (i = 0; i < c->perslab; i++, obj -= c->size) {
+    if (c->ctor)
+      c->ctor(obj);
+    *obj_link(c, obj) = s->free;
+    s->free = obj;
+  }
+  list_add(&s->list, &c->slabs);
+  c->nempty++;
+  return s;
+}
+
+// Called with c->lock held.
+static void *
+slab_take(struct kmem_cache *c, struct slab *s)
+{
+  void *obj = s->free;
+
+  s->free = *obj_link(c, obj);
+  if (s->inuse++ == 0)
+    c->nempty--;
+  if (!s->free)
+    list_del_init(&s->list);
+  return obj;
+}
+
+// Returns obj to its slab, and the slab's page to the page
+// allocator if the cache already holds another empty slab.
+// Called with c->lock held.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = obj_slab(c, obj);
+
+  if (!s->free)
+    list_add(&s->list, &c->slabs);
+  *obj_link(c, obj) = s->free;
+  s->free = obj;
+  if (--s->inuse > 0)
+    return;
+  if (c->nempty > 0) {
+    list_del(&s->list);
+    if (c->offslab) {
+      acquire(&slab_hash_lock);
+      list_del(&s->hash);
+      release(&slab_hash_lock);
+      kfree(s->page);
+      kmem_cache_free(slab_cache, s);
+    } else {
+      kfree(s);
+    }
+  } else {
+    c->nempty++;
+  }
+}
+
+// Called with interrupts off.
+static void
+mag_refill(struct kmem_cache *c, struct magazine *mg)
+{
+  struct slab *s;
+
+  acquire(&c->lock);
+  while (mg->n < MAG_BATCH) {
+    if (list_empty(&c->slabs) && !slab_grow(c))
+      break;
+    s = list_first_entry(&c->slabs, struct slab, list);
+    mg->objs[mg->n++] = slab_take(c, s);
+  }
+  release(&c->lock);
+}
+
+// Called with interrupts off.
+static void
+mag_drain(struct kmem_cache *c, struct magazine *mg)
+{
+  acquire(&c->lock);
+  while (mg->n > MAG_SIZE - MAG_BATCH)
+    slab_put(c, mg->objs[--mg->n]);
+  release(&c->lock);
+}
+
+// Returns an object from c, or 0 if out of memory.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *mg;
+  void *obj = 0;
+
+  push_off();
+  mg = &c->mag[cpuid()];
+  if (mg->n == 0)
+    mag_refill(c, mg);
+  if (mg->n > 0)
+    obj = mg->objs[--mg->n];
+  pop_off();
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *mg;
+  struct slab *s = obj_slab(c, obj);
+
+  if (!s || s->cache != c)
+    panic("kmem_cache_free");
+
+  push_off();
+  mg = &c->mag[cpuid()];
+  if (mg->n == MAG_SIZE)
+    mag_drain(c, mg);
+  mg->objs[mg->n++] = obj;
+  pop_off();
+}
+
+//
+// General-purpose allocation of small objects, from caches
+// of power-of-two size classes.
+//
+
+#define KMALLOC_MIN_SHIFT 5   // 32 bytes
+#define KMALLOC_MAX_SHIFT 11  // 2048 bytes
+#define NKMALLOC (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+static struct kmem_cache *kmalloc_caches[NKMALLOC];
+static char *kmalloc_names[NKMALLOC] = {
+  "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+  "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static void
+kmalloc_init(void)
+{
+  int i;
+
+  initlock(&slab_hash_lock, "slab_hash");
+  for (i = 0; i < NSLABHASH; i++)
+    list_init(&slab_hash[i]);
+  slab_cache = kmem_cache_create("slab", sizeof(struct slab), 0);
+
+  for (i = 0; i < NKMALLOC; i++)
+    kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+                                          1 << (i + KMALLOC_MIN_SHIFT), 0);
+}
+
+// Allocates size bytes, up to 2048. Returns 0 if the memory
+// cannot be allocated.
+void *
+kmalloc(uint size)
+{
+  int i = 0;
+
+  while ((1 << (i + KMALLOC_MIN_SHIFT)) < size)
+    if (++i == NKMALLOC)
+      return 0;
+  return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+// Frees memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct slab *s = offslab_find(p);
+
+  if (!s)
+    s = (struct slab *)PGROUNDDOWN((uint64)p);
+  kmem_cache_free(s->cache, p);
 }
@@ -8,6 +8,7 @@
 #include "mbuf.h"
 #include "spinlock.h"
 #include "net.h"
+#include "pollwait.h"
 #include "tcp.h"
 
 volatile static int started = 0;
@@ -45,10 +46,16 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    pollinit();      // epoll sets
+    statsinit();     // statistics device
     virtio_disk_init(); // emulated hard disk
+    mbufinit();      // packet buffer pools
+    arpinit();       // neighbor cache
     pci_init();
     sockinit();
     userinit();      // first user process
+    e1000_start();   // receive polling thread
     // timer_add(10, hello, NULL);
     __sync_synchronize();
     started = 1;
@@ -8,6 +8,149 @@
 #include "list.h"
 #include "mbuf.h"
 
+//
+// mbufs come from two preallocated pools: full-MTU buffers for
+// data and received frames, and small buffers for segments that
+// are only headers (ACK, SYN, FIN, RST, ARP). Buffers are carved
+// from whole pages at their own size, so each is aligned to its
+// size and to cache lines. A third pool holds bare descriptors for
+// clones (see mbufclone()), which point at the data of another mbuf
+// and so take no buffer from the other two. Each CPU caches a few free mbufs per
+// pool and moves them to and from the pool's list in batches.
+//
+
+#define MBUF_PCPU  16               // free mbufs a CPU may cache
+#define MBUF_BATCH (MBUF_PCPU / 2)  // mbufs moved at once
+
+struct mbuf_pool {
+  char *name;
+  unsigned int size;    // size of each backing store
+  int total;
+  struct spinlock lock;
+  struct mbuf *free;    // free mbufs not cached by a CPU
+  int nfree;
+  uint fail;            // allocations that found the pool empty
+  struct {
+    int n;
+    struct mbuf *bufs[MBUF_PCPU];
+  } cpu[NCPU];
+};
+
+static struct mbuf mbufs[NMBUF];
+static struct mbuf mbufs_hdr[NMBUF_HDR];
+static struct mbuf mbufs_clone[NMBUF_CLONE];
+static struct mbuf_pool mbuf_pool;
+static struct mbuf_pool mbuf_hdr_pool;
+static struct mbuf_pool mbuf_clone_pool;
+
+static void
+mbuf_pool_init(struct mbuf_pool *p, char *name, unsigned int size,
+               struct mbuf *ms, int n)
+{
+  int perpage = size ? PGSIZE / size : 0;
+  char *pa = 0;
+  int i;
+
+  p->name = name;
+  p->size = size;
+  initlock(&p->lock, name);
+  for (i = 0; i < n; i++) {
+    if (!perpage) {
+      ms[i].buf = 0;
+    } else {
+      if (i % perpage == 0 && (pa = kalloc()) == 0)
+        panic("mbufinit");
+      ms[i].buf = pa + (i % perpage) * size;
+    }
+    ms[i].size = size;
+    ms[i].pool = p;
+    ms[i].next = p->free;
+    p->free = &ms[i];
+  }
+  p->total = p->nfree = n;
+}
+
+void
+mbufinit(void)
+{
+  mbuf_pool_init(&mbuf_pool, "mbuf", MBUF_SIZE, mbufs, NMBUF);
+  mbuf_pool_init(&mbuf_hdr_pool, "mbuf_hdr", MBUF_HDR_SIZE, mbufs_hdr, NMBUF_HDR);
+  mbuf_pool_init(&mbuf_clone_pool, "mbuf_clone", 0, mbufs_clone, NMBUF_CLONE);
+}
+
+static struct mbuf *
+mbuf_pool_get(struct mbuf_pool *p)
+{
+  struct mbuf *m = 0;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if (p->cpu[id].n == 0) {
+    acquire(&p->lock);
+    while (p->cpu[id].n < MBUF_BATCH && p->free) {
+      p->cpu[id].bufs[p->cpu[id].n++] = p->free;
+      p->free = p->free->next;
+      p->nfree--;
+    }
+    release(&p->lock);
+  }
+  if (p->cpu[id].n > 0)
+    m = p->cpu[id].bufs[--p->cpu[id].n];
+  pop_off();
+
+  if (!m)
+    __sync_fetch_and_add(&p->fail, 1);
+  return m;
+}
+
+static void
+mbuf_pool_put(struct mbuf_pool *p, struct mbuf *m)
+{
+  struct mbuf *n;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if (p->cpu[id].n == MBUF_PCPU) {
+    acquire(&p->lock);
+    while (p->cpu[id].n > MBUF_PCPU - MBUF_BATCH) {
+      n = p->cpu[id].bufs[--p->cpu[id].n];
+      n->next = p->free;
+      p->free = n;
+      p->nfree++;
+    }
+    release(&p->lock);
+  }
+  p->cpu[id].bufs[p->cpu[id].n++] = m;
+  pop_off();
+}
+
+static int
+snprint_pool(char *buf, int sz, struct mbuf_pool *p)
+{
+  int i, nfree = p->nfree;
+
+  for (i = 0; i < NCPU; i++)
+    nfree += p->cpu[i].n;
+  return snprintf(buf, sz, "%s: size %d total %d inuse %d fail %d\n",
+                  p->name, p->size, p->total, p->total - nfree, p->fail);
+}
+
+// Reports pool occupancy for the statistics device. The counts
+// are read without locks, so they are only a snapshot.
+int
+statsmbuf(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- mbuf pools\n");
+  n += snprint_pool(buf+n, sz-n, &mbuf_pool);
+  n += snprint_pool(buf+n, sz-n, &mbuf_hdr_pool);
+  n += snprint_pool(buf+n, sz-n, &mbuf_clone_pool);
+  return n;
+}
+
 // Strips data from the start of the buffer and returns a pointer to it.
 // Returns 0 if less than the full requested length is available.
 char *
@@ -38,7 +181,7 @@ mbufput(struct mbuf *m, unsigned int len)
 {
   char *tmp = m->head + m->len;
   m->len += len;
-  if (m->len > MBUF_SIZE)
+  if (m->head + m->len > m->buf + m->size)
     panic("mbufput");
   return tmp;
 }
@@ -54,31 +197,84 @@ mbuftrim(struct mbuf *m, unsigned int len)
   return m->head + m->len;
 }
 
-// Allocates a packet buffer.
-struct mbuf *
-mbufalloc(unsigned int headroom)
+static struct mbuf *
+mbufget(struct mbuf_pool *p, unsigned int headroom)
 {
   struct mbuf *m;
- 
-  if (headroom > MBUF_SIZE)
+
+  if (headroom > p->size)
     return 0;
-  m = kalloc();
+  m = mbuf_pool_get(p);
   if (m == 0)
     return 0;
   m->next = 0;
-  m->head = (char *)m->buf + headroom;
+  m->frag = 0;
+  m->head = m->buf + headroom;
   m->len = 0;
   m->refcnt = 0;
-  memset(m->buf, 0, sizeof(m->buf));
+  m->csum = 0;
+  m->gso_size = 0;
+  m->shared = 0;
   return m;
 }
 
-// Frees a packet buffer.
+// Allocates a full-MTU packet buffer. The buffer is not zeroed.
+struct mbuf *
+mbufalloc(unsigned int headroom)
+{
+  return mbufget(&mbuf_pool, headroom);
+}
+
+// Allocates a packet buffer with room for headroom plus the
+// headers and options of a segment that carries no data.
+struct mbuf *
+mbufalloc_hdr(unsigned int headroom)
+{
+  return mbufget(&mbuf_hdr_pool, headroom);
+}
+
+// Returns a buffer that points at the data of m, so that the data
+// can be chained into another packet without being copied. The
+// clone holds a reference to m until it is freed.
+struct mbuf *
+mbufclone(struct mbuf *m)
+{
+  struct mbuf *c;
+
+  c = mbufget(&mbuf_clone_pool, 0);
+  if (c == 0)
+    return 0;
+  c->head = m->head;
+  c->len = m->len;
+  c->shared = m;
+  mbufhold(m);
+  return c;
+}
+
+// Takes a reference to m. TCP and the driver share write queue
+// buffers and drop their references under different locks, or in
+// the interrupt handler, so the count is updated atomically.
+void
+mbufhold(struct mbuf *m)
+{
+  __sync_fetch_and_add(&m->refcnt, 1);
+}
+
+// Frees a packet buffer, and the rest of its chain. A buffer
+// that is still referenced keeps the buffers chained behind it.
 void
 mbuffree(struct mbuf *m)
 {
-  if (--m->refcnt <= 0)
-    kfree(m);
+  struct mbuf *frag, *shared;
+
+  while (m && __sync_sub_and_fetch(&m->refcnt, 1) <= 0) {
+    frag = m->frag;
+    shared = m->shared;
+    mbuf_pool_put(m->pool, m);
+    if (shared)
+      mbuffree(shared);
+    m = frag;
+  }
 }
 
 // Pushes an mbuf to the end of the queue.
@@ -2,22 +2,55 @@
 // packet buffer management
 //
 
-#define MBUF_SIZE 2048
+#define MBUF_SIZE 2048          // backing store of a full-MTU mbuf
+#define MBUF_HDR_SIZE 256       // backing store of a header-only mbuf
 #define MBUF_DEFAULT_HEADROOM 128
 
+#define NMBUF 1024              // full-MTU mbufs in the pool
+#define NMBUF_HDR 512           // header-only mbufs in the pool
+#define NMBUF_CLONE 512         // clone descriptors, without a backing store
+
+struct mbuf_pool;
+
 struct mbuf {
-  struct mbuf *next;   // the next mbuf in the chain
+  struct mbuf *next;   // the next mbuf in a queue (see mbufq)
+  struct mbuf *frag;   // the next buffer of the same packet
   char *head;          // the current start position of the buffer
   unsigned int len;    // the length of the buffer
-  char buf[MBUF_SIZE]; // the backing store
+  char *buf;           // the backing store
+  unsigned int size;   // the size of the backing store
+  struct mbuf_pool *pool; // the pool the mbuf returns to
 
   // TCP used
-  int refcnt;
+  int refcnt;     // updated atomically, see mbufhold() and mbuffree()
   uint32 seq;     // first sequence number of a segment
   uint32 end_seq; // last sequence number of a segment
+  char *tcphdr;   // TCP header of a segment on the write queue
+  int sacked;     // the peer has SACKed this segment
+  int psh;        // a received segment carried PSH
   struct list_head list;
+
+  // UDP used
+  uint32 raddr;   // source address of a received datagram
+  uint16 rport;   // source port of a received datagram
+
+  int csum;       // MBUF_CSUM_* flags of the first mbuf of a packet
+  uint16 gso_size; // if set, a TCP super-segment of segments this long
+  struct mbuf *shared; // a clone's data belongs to this mbuf
 };
 
+// On transmit, the checksums the device is to fill in. The TCP or
+// UDP checksum field then holds the pseudo-header sum, which the
+// device adds the segment to.
+#define MBUF_CSUM_IP      0x01
+#define MBUF_CSUM_TCP     0x02
+#define MBUF_CSUM_UDP     0x04
+// On receive, what the device found checking the checksums.
+#define MBUF_CSUM_IP_OK   0x10
+#define MBUF_CSUM_IP_BAD  0x20
+#define MBUF_CSUM_L4_OK   0x40  // TCP or UDP
+#define MBUF_CSUM_L4_BAD  0x80
+
 char *mbufpull(struct mbuf *m, unsigned int len);
 char *mbufpush(struct mbuf *m, unsigned int len);
 char *mbufput(struct mbuf *m, unsigned int len);
@@ -27,7 +60,7 @@ char *mbuftrim(struct mbuf *m, unsigned int len);
 //            <- push            <- trim
 //             -> pull            -> put
 // [-headroom-][------buffer------][-tailroom-]
-// |----------------MBUF_SIZE-----------------|
+// |------------------size--------------------|
 //
 // These marcos automatically typecast and determine the size of header structs.
 // In most situations you should use these instead of the raw ops above.
@@ -36,8 +69,27 @@ char *mbuftrim(struct mbuf *m, unsigned int len);
 #define mbufputhdr(mbuf, hdr) (typeof(hdr) *)mbufput(mbuf, sizeof(hdr))
 #define mbuftrimhdr(mbuf, hdr) (typeof(hdr) *)mbuftrim(mbuf, sizeof(hdr))
 
+// A packet may be a chain of mbufs linked through frag, e.g. the
+// headers in a small mbuf followed by the payload in another. Only
+// the first mbuf has headroom to push headers into. mbuffree() on
+// the first mbuf drops a reference to every mbuf in the chain.
+static _inline unsigned int
+mbuf_pktlen(struct mbuf *m)
+{
+  unsigned int len = 0;
+
+  for (; m; m = m->frag)
+    len += m->len;
+  return len;
+}
+
 struct mbuf *mbufalloc(unsigned int headroom);
+struct mbuf *mbufalloc_hdr(unsigned int headroom);
+struct mbuf *mbufclone(struct mbuf *m);
+void mbufhold(struct mbuf *m);
 void mbuffree(struct mbuf *m);
+void mbufinit(void);
+int statsmbuf(char *buf, int sz);
 
 struct mbufq {
   struct mbuf *head; // the first element in the queue
@@ -104,6 +156,21 @@ mbuf_queue_peek(struct mbuf_queue *q)
   return list_first_entry(&q->head, struct mbuf, list);
 }
 
+static _inline struct mbuf *
+mbuf_queue_peek_tail(struct mbuf_queue *q)
+{
+  if (mbuf_queue_empty(q))
+    return NULL;
+  return list_last_entry(&q->head, struct mbuf, list);
+}
+
+static _inline void
+mbuf_unlink(struct mbuf_queue *q, struct mbuf *m)
+{
+  list_del(&m->list);
+  q->len--;
+}
+
 static _inline void
 mbuf_queue_free(struct mbuf_queue *q)
 {
@@ -14,11 +14,14 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "pollwait.h"
 #include "tcp.h"
 
 uint32 local_ip = MAKE_IP_ADDR(10, 0, 2, 15); // qemu's idea of the guest IP
 uint8 local_mac[ETHADDR_LEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
 uint8 broadcast_mac[ETHADDR_LEN] = { 0xFF, 0XFF, 0XFF, 0XFF, 0XFF, 0XFF };
+uint32 net_offload; // NET_OFFLOAD_* flags, set by the driver
+uint32 net_gso_max_segs = 16; // segments in a TCP super-segment
 
 // This code is lifted from FreeBSD's ping.c, and is copyright by the Regents
 // of the University of California.
@@ -55,18 +58,116 @@ in_cksum(const unsigned char *addr, int len)
   return answer;
 }
 
-// sends an ethernet packet
+// Returns the folded, uncomplemented sum of the TCP/UDP pseudo
+// header, for a device to add the segment to. The addresses are
+// in network byte order.
+uint16
+in_pseudo_sum(uint32 saddr, uint32 daddr, uint8 proto, uint16 len)
+{
+  uint32 sum;
+
+  sum = (saddr & 0xffff) + (saddr >> 16);
+  sum += (daddr & 0xffff) + (daddr >> 16);
+  sum += htons(proto);
+  sum += htons(len);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum += (sum >> 16);
+  return sum;
+}
+
+// Cuts the TCP super-segment m, which starts with its IP header,
+// into the segments it stands for, when the device cannot. The
+// first mbuf holds the IP and TCP headers, and each mbuf chained
+// behind it the data of one segment (see tcp_transmit_gso()).
 static void
-net_tx_eth(struct mbuf *m, uint16 ethtype)
+net_gso_segment(struct mbuf *m, struct mbufq *q)
+{
+  struct mbuf *d, *next, *s;
+  struct ip *iphdr;
+  struct tcp_hdr *th;
+  int hlen = m->len;
+  uint32 seq, dseq;
+
+  th = (struct tcp_hdr *)(m->head + sizeof(*iphdr));
+  seq = ntohl(th->seq);
+
+  for (d = m->frag; d; d = next) {
+    next = d->frag;
+    d->frag = 0;
+    // advance first: the segments behind a lost one keep their place
+    dseq = seq;
+    seq += d->len;
+    // a segment that cannot be sent is lost, to be retransmitted
+    if ((s = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM)) == 0) {
+      mbuffree(d);
+      continue;
+    }
+    memmove(mbufput(s, hlen), m->head, hlen);
+    s->frag = d;
+    s->csum = m->csum;
+
+    iphdr = (struct ip *)s->head;
+    iphdr->ip_len = htons(hlen + d->len);
+    if (!(s->csum & MBUF_CSUM_IP)) {
+      iphdr->ip_sum = 0;
+      iphdr->ip_sum = in_cksum((unsigned char *)iphdr, sizeof(*iphdr));
+    }
+
+    // only the last segment keeps PSH and FIN
+    th = (struct tcp_hdr *)(s->head + sizeof(*iphdr));
+    th->seq = htonl(dseq);
+    if (next) {
+      th->psh = 0;
+      th->fin = 0;
+    }
+    if (s->csum & MBUF_CSUM_TCP) {
+      th->checksum = in_pseudo_sum(iphdr->ip_src, iphdr->ip_dst, IPPROTO_TCP,
+                                   hlen - sizeof(*iphdr) + d->len);
+    } else {
+      th->checksum = 0;
+      mbufpull(s, sizeof(*iphdr));
+      th->checksum = tcp_v4_checksum(s, iphdr->ip_src, iphdr->ip_dst);
+      mbufpush(s, sizeof(*iphdr));
+    }
+    mbufq_pushtail(q, s);
+  }
+
+  m->frag = 0;
+  mbuffree(m);
+}
+
+// Returns how many segments of a TCP super-segment the device
+// can take right now. With TSO a super-segment takes a context and
+// a header descriptor besides one per segment; in software each
+// segment goes out as a header and its data.
+int
+net_gso_room(void)
+{
+  int free = e1000_tx_free();
+
+  if (net_offload & NET_OFFLOAD_TSO)
+    return free - 2;
+  return (free - 1) / 2;
+}
+
+// sends an ethernet packet to dhost
+void
+net_tx_eth(struct mbuf *m, uint16 ethtype, uint8 *dhost)
 {
   struct eth *ethhdr;
+  struct mbufq q;
+
+  if (m->gso_size && !(net_offload & NET_OFFLOAD_TSO)) {
+    mbufq_init(&q);
+    net_gso_segment(m, &q);
+    while (!mbufq_empty(&q))
+      net_tx_eth(mbufq_pophead(&q), ethtype, dhost);
+    return;
+  }
 
   ethhdr = mbufpushhdr(m, *ethhdr);
   memmove(ethhdr->shost, local_mac, ETHADDR_LEN);
-  // In a real networking stack, dhost would be set to the address discovered
-  // through ARP. Because we don't support enough of the ARP protocol, set it
-  // to broadcast instead.
-  memmove(ethhdr->dhost, broadcast_mac, ETHADDR_LEN);
+  memmove(ethhdr->dhost, dhost, ETHADDR_LEN);
   ethhdr->type = htons(ethtype);
   if (e1000_transmit(m)) {
     mbuffree(m);
@@ -86,12 +187,15 @@ net_tx_ip(struct mbuf *m, uint8 proto, uint32 dip)
   iphdr->ip_p = proto;
   iphdr->ip_src = htonl(local_ip);
   iphdr->ip_dst = htonl(dip);
-  iphdr->ip_len = htons(m->len);
+  iphdr->ip_len = htons(mbuf_pktlen(m));
   iphdr->ip_ttl = 100;
-  iphdr->ip_sum = in_cksum((unsigned char *)iphdr, sizeof(*iphdr));
+  if (net_offload & NET_OFFLOAD_CSUM)
+    m->csum |= MBUF_CSUM_IP;
+  else
+    iphdr->ip_sum = in_cksum((unsigned char *)iphdr, sizeof(*iphdr));
 
-  // now on to the ethernet layer
-  net_tx_eth(m, ETHTYPE_IP);
+  // find the next hop, then on to the ethernet layer
+  arp_output(m, dip);
 }
 
 // sends a UDP packet
@@ -105,76 +209,31 @@ net_tx_udp(struct mbuf *m, uint32 dip,
   udphdr = mbufpushhdr(m, *udphdr);
   udphdr->sport = htons(sport);
   udphdr->dport = htons(dport);
-  udphdr->ulen = htons(m->len);
+  udphdr->ulen = htons(mbuf_pktlen(m));
   udphdr->sum = 0; // zero means no checksum is provided
+  if (net_offload & NET_OFFLOAD_CSUM) {
+    udphdr->sum = in_pseudo_sum(htonl(local_ip), htonl(dip),
+                                IPPROTO_UDP, mbuf_pktlen(m));
+    m->csum |= MBUF_CSUM_UDP;
+  }
 
   // now on to the IP layer
   net_tx_ip(m, IPPROTO_UDP, dip);
 }
 
-// sends an ARP packet
-static int
-net_tx_arp(uint16 op, uint8 dmac[ETHADDR_LEN], uint32 dip)
+// Checksums a received UDP datagram, pseudo header included.
+// Returns 0 if the checksum is correct.
+static uint16
+udp_checksum(struct ip *iphdr, struct udp *udphdr)
 {
-  struct mbuf *m;
-  struct arp *arphdr;
-
-  m = mbufalloc(MBUF_DEFAULT_HEADROOM);
-  if (!m)
-    return -1;
-
-  // generic part of ARP header
-  arphdr = mbufputhdr(m, *arphdr);
-  arphdr->hrd = htons(ARP_HRD_ETHER);
-  arphdr->pro = htons(ETHTYPE_IP);
-  arphdr->hln = ETHADDR_LEN;
-  arphdr->pln = sizeof(uint32);
-  arphdr->op = htons(op);
-
-  // ethernet + IP part of ARP header
-  memmove(arphdr->sha, local_mac, ETHADDR_LEN);
-  arphdr->sip = htonl(local_ip);
-  memmove(arphdr->tha, dmac, ETHADDR_LEN);
-  arphdr->tip = htonl(dip);
-
-  // header is ready, send the packet
-  net_tx_eth(m, ETHTYPE_ARP);
-  return 0;
-}
-
-// receives an ARP packet
-static void
-net_rx_arp(struct mbuf *m)
-{
-  struct arp *arphdr;
-  uint8 smac[ETHADDR_LEN];
-  uint32 sip, tip;
-
-  arphdr = mbufpullhdr(m, *arphdr);
-  if (!arphdr)
-    goto done;
-
-  // validate the ARP header
-  if (ntohs(arphdr->hrd) != ARP_HRD_ETHER ||
-      ntohs(arphdr->pro) != ETHTYPE_IP ||
-      arphdr->hln != ETHADDR_LEN ||
-      arphdr->pln != sizeof(uint32)) {
-    goto done;
-  }
+  uint16 len = ntohs(udphdr->ulen);
+  uint32 sum;
 
-  // only requests are supported so far
-  // check if our IP was solicited
-  tip = ntohl(arphdr->tip); // target IP address
-  if (ntohs(arphdr->op) != ARP_OP_REQUEST || tip != local_ip)
-    goto done;
-
-  // handle the ARP request
-  memmove(smac, arphdr->sha, ETHADDR_LEN); // sender's ethernet address
-  sip = ntohl(arphdr->sip); // sender's IP address (qemu's slirp)
-  net_tx_arp(ARP_OP_REPLY, smac, sip);
-
-done:
-  mbuffree(m);
+  sum = in_pseudo_sum(iphdr->ip_src, iphdr->ip_dst, IPPROTO_UDP, len);
+  sum += (uint16)~in_cksum((unsigned char *)udphdr, len);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum += (sum >> 16);
+  return ~sum;
 }
 
 // receives a UDP packet
@@ -190,14 +249,18 @@ net_rx_udp(struct mbuf *m, uint16 len, struct ip *iphdr)
   if (!udphdr)
     goto fail;
 
-  // TODO: validate UDP checksum
-
   // validate lengths reported in headers
   if (ntohs(udphdr->ulen) != len)
     goto fail;
   len -= sizeof(*udphdr);
   if (len > m->len)
     goto fail;
+
+  // a zero checksum was not computed; otherwise validate it,
+  // unless the e1000 did
+  if (udphdr->sum && ((m->csum & MBUF_CSUM_L4_BAD) ||
+      (!(m->csum & MBUF_CSUM_L4_OK) && udp_checksum(iphdr, udphdr) != 0)))
+    goto fail;
   // minimum packet size could be larger than the payload
   // mbuftrim(m, m->len - len);
 
@@ -271,8 +334,11 @@ net_rx_ip(struct mbuf *m)
   // check IP version and header len
   if (iphdr->ip_vhl != ((4 << 4) | (20 >> 2)))
     goto fail;
-  // validate IP checksum
-  if (in_cksum((unsigned char *)iphdr, sizeof(*iphdr)))
+  // validate IP checksum, unless the e1000 did
+  if (m->csum & MBUF_CSUM_IP_BAD)
+    goto fail;
+  if (!(m->csum & MBUF_CSUM_IP_OK) &&
+      in_cksum((unsigned char *)iphdr, sizeof(*iphdr)))
     goto fail;
   // can't support fragmented IP packets
   if (htons(iphdr->ip_off) != 0)
@@ -306,7 +372,7 @@ void net_rx(struct mbuf *m)
   struct eth *ethhdr;
   uint16 type;
 
-  m->refcnt++;
+  mbufhold(m);
 
   ethhdr = mbufpullhdr(m, *ethhdr);
   if (!ethhdr) {
@@ -4,6 +4,15 @@ typedef uint32 ip_addr_t;
 
 #define SOCK_STREAM 1
 #define SOCK_DGRAM 2
+#define SOCK_NONBLOCK 0x800 // or-ed into the type, same as O_NONBLOCK
+
+// setsockopt() options at level SOL_SOCKET
+#define SOL_SOCKET 1
+#define SO_REUSEPORT 15 // listeners may share a port, connections are spread
+
+// setsockopt() options at level IPPROTO_TCP
+#define TCP_NODELAY 1 // send small segments at once, no Nagle
+#define TCP_CORK 3    // send only full segments until uncorked
 
 
 #define INADDR_ANY ((ip_addr_t)0)
@@ -84,6 +93,10 @@ struct ip {
 
 #define IP_ADDR_LEN 16
 
+// offloads of the network device (see net_offload)
+#define NET_OFFLOAD_CSUM 0x1 // IPv4 header, TCP and UDP checksums
+#define NET_OFFLOAD_TSO  0x2 // TCP segmentation
+
 #define MAKE_IP_ADDR(a, b, c, d)           \
   (((uint32)a << 24) | ((uint32)b << 16) | \
    ((uint32)c << 8) | (uint32)d)
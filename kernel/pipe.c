@@ -7,6 +7,9 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "list.h"
+#include "poll.h"
+#include "pollwait.h"
 
 #define PIPESIZE 512
 
@@ -17,8 +20,17 @@ struct pipe {
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct pollhead ph;  // poll() and epoll waiters on either end
 };
 
+static struct kmem_cache *pipe_cache;
+
+void
+pipeinit(void)
+{
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), 0);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +40,14 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipe_cache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
   initlock(&pi->lock, "pipe");
+  pollhead_init(&pi->ph);
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +60,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,9 +79,10 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwake(&pi->ph);
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   } else
     release(&pi->lock);
 }
@@ -87,6 +101,7 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       wakeup(&pi->nread);
+      pollwake(&pi->ph);
       sleep(&pi->nwrite, &pi->lock);
     } else {
       char ch;
@@ -97,6 +112,7 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     }
   }
   wakeup(&pi->nread);
+  pollwake(&pi->ph);
   release(&pi->lock);
 
   return i;
@@ -125,6 +141,32 @@ piperead(struct pipe *pi, uint64 addr, int n)
       break;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pollwake(&pi->ph);
   release(&pi->lock);
   return i;
 }
+
+// The read end is readable when there is data or the write end
+// is closed; the write end is writable when there is room.
+int
+pipepoll(struct pipe *pi, int writable, struct pollhead **ph)
+{
+  int mask = 0;
+
+  if(ph)
+    *ph = &pi->ph;
+  acquire(&pi->lock);
+  if(writable){
+    if(pi->readopen == 0)
+      mask |= POLLERR;
+    else if(pi->nwrite != pi->nread + PIPESIZE)
+      mask |= POLLOUT;
+  } else {
+    if(pi->nread != pi->nwrite)
+      mask |= POLLIN;
+    if(pi->writeopen == 0)
+      mask |= POLLIN | POLLHUP;
+  }
+  release(&pi->lock);
+  return mask;
+}
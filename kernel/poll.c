@@ -0,0 +1,463 @@
+//
+// poll() and epoll: waiting for events on many files at once.
+//
+// TCP and UDP sockets, pipes and the console embed a pollhead,
+// and call pollwake() next to each wakeup() of their readers
+// and writers. poll() hangs a waiter on every pollhead it
+// watches for the length of one call. An epoll set keeps one
+// waiter per watched file, which queues the file on the set's
+// ready list, so that epoll_wait() only looks at files that
+// have signalled something since it last ran.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "list.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+#include "timer.h"
+#include "poll.h"
+#include "pollwait.h"
+
+struct eventpoll {
+  struct spinlock lock;     // protects rdlist and epi->ready
+  struct list_head items;   // all epitems of the set
+  struct list_head rdlist;  // epitems signalled since the last epoll_wait()
+  struct pollhead ph;       // epoll_wait() and poll() callers
+};
+
+struct epitem {
+  struct list_head link;    // link in ep->items
+  struct list_head rdlink;  // link in ep->rdlist, if ready
+  int ready;                // on ep->rdlist
+  struct eventpoll *ep;
+  struct file *file;        // watched file
+  struct epitem *fnext;     // next epitem of the same file
+  uint32 events;            // EPOLL* mask asked for
+  uint64 data;
+  struct pollwaiter wait;
+};
+
+// Protects the item lists of all epoll sets and of all files.
+static struct spinlock epoll_lock;
+
+void
+pollinit(void)
+{
+  initlock(&epoll_lock, "epoll");
+}
+
+void
+pollhead_init(struct pollhead *ph)
+{
+  initlock(&ph->lock, "pollhead");
+  list_init(&ph->waiters);
+}
+
+void
+pollwake(struct pollhead *ph)
+{
+  struct pollwaiter *w;
+
+  acquire(&ph->lock);
+  list_for_each_entry(w, &ph->waiters, list)
+    w->notify(w);
+  release(&ph->lock);
+}
+
+void
+pollwait_add(struct pollhead *ph, struct pollwaiter *w,
+             void (*notify)(struct pollwaiter *), void *arg)
+{
+  w->ph = ph;
+  w->notify = notify;
+  w->arg = arg;
+  acquire(&ph->lock);
+  list_add_tail(&w->list, &ph->waiters);
+  release(&ph->lock);
+}
+
+void
+pollwait_del(struct pollwaiter *w)
+{
+  if (!w->ph)
+    return;
+  acquire(&w->ph->lock);
+  list_del(&w->list);
+  release(&w->ph->lock);
+  w->ph = 0;
+}
+
+//
+// A process waiting in poll() or epoll_wait().
+//
+
+static void
+poll_notify(struct pollwaiter *w)
+{
+  struct proc *p = w->arg;
+
+  acquire(&p->polllk);
+  p->pollev = 1;
+  wakeup(&p->pollev);
+  release(&p->polllk);
+}
+
+static void *
+poll_timeout(void *arg)
+{
+  struct proc *p = arg;
+
+  acquire(&p->polllk);
+  /* the call returned, or another one started */
+  if (!p->polltimer || p->polltimer->expires > ticks) {
+    release(&p->polllk);
+    return NULL;
+  }
+  timer_release(p->polltimer);
+  p->polltimer = NULL;
+  p->polltimedout = 1;
+  wakeup(&p->pollev);
+  release(&p->polllk);
+  return NULL;
+}
+
+// Starts a wait of timeout milliseconds, forever if negative.
+static void
+poll_begin(struct proc *p, int timeout)
+{
+  acquire(&p->polllk);
+  p->pollev = 0;
+  p->polltimedout = timeout == 0;
+  p->polltimer = NULL;
+  if (timeout > 0) {
+    /* a tick is 100ms */
+    p->polltimer = timer_add((timeout + 99) / 100, poll_timeout, p);
+    if (!p->polltimer)
+      p->polltimedout = 1;
+  }
+  release(&p->polllk);
+}
+
+static void
+poll_end(struct proc *p)
+{
+  acquire(&p->polllk);
+  if (p->polltimer) {
+    timer_cancel(p->polltimer);
+    p->polltimer = NULL;
+  }
+  release(&p->polllk);
+}
+
+// Sleeps until a watched object signals, the timeout passes
+// or p is killed. Returns 0 if the caller should look again,
+// -1 if it should give up.
+static int
+poll_sleep(struct proc *p)
+{
+  int r;
+
+  acquire(&p->polllk);
+  while (!p->pollev && !p->polltimedout && !p->killed)
+    sleep(&p->pollev, &p->polllk);
+  p->pollev = 0;
+  r = (p->polltimedout || p->killed) ? -1 : 0;
+  release(&p->polllk);
+  return r;
+}
+
+static struct file *
+poll_getfile(struct proc *p, int fd)
+{
+  if (fd < 0 || fd >= NOFILE)
+    return 0;
+  return p->ofile[fd];
+}
+
+// Waits for events on the nfds files in fds, which is in kernel
+// memory, and returns how many have some.
+int
+pollfds(struct pollfd *fds, int nfds, int timeout)
+{
+  struct proc *p = myproc();
+  struct pollwaiter ws[NOFILE];
+  struct pollhead *ph;
+  struct file *f;
+  int i, n;
+
+  poll_begin(p, timeout);
+
+  /* hang the waiters first, so that no event goes unnoticed */
+  for (i = 0; i < nfds; i++) {
+    ws[i].ph = 0;
+    if ((f = poll_getfile(p, fds[i].fd)) == 0)
+      continue;
+    filepoll(f, &ph);
+    if (ph)
+      pollwait_add(ph, &ws[i], poll_notify, p);
+  }
+
+  for (;;) {
+    n = 0;
+    for (i = 0; i < nfds; i++) {
+      fds[i].revents = 0;
+      if (fds[i].fd < 0)
+        continue;
+      if ((f = poll_getfile(p, fds[i].fd)) == 0)
+        fds[i].revents = POLLNVAL;
+      else
+        fds[i].revents = filepoll(f, 0) & (fds[i].events | POLLERR | POLLHUP);
+      if (fds[i].revents)
+        n++;
+    }
+    if (n || poll_sleep(p) < 0)
+      break;
+  }
+
+  for (i = 0; i < nfds; i++)
+    pollwait_del(&ws[i]);
+  poll_end(p);
+
+  if (!n && p->killed)
+    return -1;
+  return n;
+}
+
+//
+// epoll
+//
+
+struct eventpoll *
+epollalloc(void)
+{
+  struct eventpoll *ep;
+
+  if ((ep = kmalloc(sizeof(*ep))) == 0)
+    return 0;
+  initlock(&ep->lock, "eventpoll");
+  list_init(&ep->items);
+  list_init(&ep->rdlist);
+  pollhead_init(&ep->ph);
+  return ep;
+}
+
+// Called on each pollwake() of a watched file.
+static void
+ep_notify(struct pollwaiter *w)
+{
+  struct epitem *epi = w->arg;
+  struct eventpoll *ep = epi->ep;
+
+  acquire(&ep->lock);
+  if (!epi->ready) {
+    epi->ready = 1;
+    list_add_tail(&epi->rdlink, &ep->rdlist);
+  }
+  release(&ep->lock);
+  pollwake(&ep->ph);
+}
+
+// Unlinks epi from its file's chain. Caller holds epoll_lock.
+static void
+ep_unlink_file(struct epitem *epi)
+{
+  struct epitem **pp;
+
+  for (pp = &epi->file->epitems; *pp != epi; pp = &(*pp)->fnext)
+    ;
+  *pp = epi->fnext;
+}
+
+// Frees epi, which is off its file's chain. Caller holds epoll_lock.
+static void
+ep_remove(struct epitem *epi)
+{
+  struct eventpoll *ep = epi->ep;
+
+  pollwait_del(&epi->wait);
+  acquire(&ep->lock);
+  if (epi->ready)
+    list_del(&epi->rdlink);
+  release(&ep->lock);
+  list_del(&epi->link);
+  kmfree(epi);
+}
+
+int
+epollctl(struct eventpoll *ep, int op, struct file *f, struct epoll_event *ev)
+{
+  struct epitem *epi;
+  struct pollhead *ph;
+  int r = 0;
+
+  /* nested sets could wake each other in circles */
+  if (f->type == FD_EPOLL)
+    return -1;
+
+  acquire(&epoll_lock);
+  for (epi = f->epitems; epi && epi->ep != ep; epi = epi->fnext)
+    ;
+
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    if (epi || (epi = kmalloc(sizeof(*epi))) == 0) {
+      r = -1;
+      break;
+    }
+    epi->ep = ep;
+    epi->file = f;
+    epi->ready = 0;
+    epi->wait.arg = epi;
+    epi->events = ev->events;
+    epi->data = ev->data;
+    epi->fnext = f->epitems;
+    f->epitems = epi;
+    list_add_tail(&epi->link, &ep->items);
+    epi->wait.ph = 0;
+    filepoll(f, &ph);
+    if (ph)
+      pollwait_add(ph, &epi->wait, ep_notify, epi);
+    /* let the next epoll_wait() look at the file once */
+    ep_notify(&epi->wait);
+    break;
+  case EPOLL_CTL_MOD:
+    if (!epi) {
+      r = -1;
+      break;
+    }
+    epi->events = ev->events;
+    epi->data = ev->data;
+    ep_notify(&epi->wait);
+    break;
+  case EPOLL_CTL_DEL:
+    if (!epi) {
+      r = -1;
+      break;
+    }
+    ep_unlink_file(epi);
+    ep_remove(epi);
+    break;
+  default:
+    r = -1;
+  }
+  release(&epoll_lock);
+  return r;
+}
+
+// Moves up to max ready files off the ready list into evs.
+// Only files that were signalled are polled. A level-triggered
+// file that is still ready goes back on the list, to be
+// reported again by the next call.
+static int
+ep_collect(struct eventpoll *ep, struct epoll_event *evs, int max)
+{
+  struct epitem *batch[EP_MAXEVENTS];
+  struct epitem *epi;
+  uint32 mask;
+  int i, nb, n;
+
+  acquire(&epoll_lock);
+  acquire(&ep->lock);
+  for (nb = 0; nb < max && !list_empty(&ep->rdlist); nb++) {
+    epi = list_first_entry(&ep->rdlist, struct epitem, rdlink);
+    list_del(&epi->rdlink);
+    epi->ready = 0;
+    batch[nb] = epi;
+  }
+  release(&ep->lock);
+
+  n = 0;
+  for (i = 0; i < nb; i++) {
+    epi = batch[i];
+    mask = filepoll(epi->file, 0) & (epi->events | POLLERR | POLLHUP);
+    if (!mask)
+      continue;
+    evs[n].events = mask;
+    evs[n].data = epi->data;
+    n++;
+    if (epi->events & EPOLLET)
+      continue;
+    acquire(&ep->lock);
+    if (!epi->ready) {
+      epi->ready = 1;
+      list_add_tail(&epi->rdlink, &ep->rdlist);
+    }
+    release(&ep->lock);
+  }
+  release(&epoll_lock);
+  return n;
+}
+
+// Waits for events on the set, and returns up to max of them
+// in evs, which is in kernel memory.
+int
+epollwait(struct eventpoll *ep, struct epoll_event *evs, int max, int timeout)
+{
+  struct proc *p = myproc();
+  struct pollwaiter w;
+  int n;
+
+  if (max > EP_MAXEVENTS)
+    max = EP_MAXEVENTS;
+
+  poll_begin(p, timeout);
+  pollwait_add(&ep->ph, &w, poll_notify, p);
+  while ((n = ep_collect(ep, evs, max)) == 0 && poll_sleep(p) == 0)
+    ;
+  pollwait_del(&w);
+  poll_end(p);
+
+  if (!n && p->killed)
+    return -1;
+  return n;
+}
+
+// An epoll set is readable while its ready list is not empty.
+int
+epollpoll(struct eventpoll *ep, struct pollhead **ph)
+{
+  int mask;
+
+  if (ph)
+    *ph = &ep->ph;
+  acquire(&ep->lock);
+  mask = list_empty(&ep->rdlist) ? 0 : POLLIN;
+  release(&ep->lock);
+  return mask;
+}
+
+void
+epollclose(struct eventpoll *ep)
+{
+  struct epitem *epi;
+
+  acquire(&epoll_lock);
+  while (!list_empty(&ep->items)) {
+    epi = list_first_entry(&ep->items, struct epitem, link);
+    ep_unlink_file(epi);
+    ep_remove(epi);
+  }
+  release(&epoll_lock);
+  kmfree(ep);
+}
+
+// Drops f from every set that watches it, when it is closed.
+void
+epollrelease(struct file *f)
+{
+  struct epitem *epi;
+
+  acquire(&epoll_lock);
+  while ((epi = f->epitems) != 0) {
+    f->epitems = epi->fnext;
+    ep_remove(epi);
+  }
+  release(&epoll_lock);
+}
@@ -0,0 +1,30 @@
+// poll() and epoll events, shared with user programs.
+
+#define POLLIN   0x001  // there is data to read
+#define POLLPRI  0x002  // there is urgent data to read
+#define POLLOUT  0x004  // writing will not block
+#define POLLERR  0x008  // error condition (revents only)
+#define POLLHUP  0x010  // hung up (revents only)
+#define POLLNVAL 0x020  // fd is not open (revents only)
+
+struct pollfd {
+  int fd;         // file descriptor, ignored if negative
+  short events;   // requested events
+  short revents;  // returned events
+};
+
+#define EPOLLIN  POLLIN
+#define EPOLLPRI POLLPRI
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLLET  (1U << 31) // report a change once, not while it lasts
+
+#define EPOLL_CTL_ADD 1  // watch a file
+#define EPOLL_CTL_DEL 2  // stop watching a file
+#define EPOLL_CTL_MOD 3  // change the events of a watched file
+
+struct epoll_event {
+  uint32 events;  // EPOLL* mask
+  uint64 data;    // returned unchanged with the events
+};
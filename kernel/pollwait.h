@@ -0,0 +1,22 @@
+// Wait queues for poll() and epoll.
+//
+// Every object that poll() can watch embeds a pollhead and calls
+// pollwake() wherever it wakes up its own readers or writers.
+// A poller hangs a pollwaiter on the pollhead, whose notify
+// function is called, with the pollhead's lock held, on each
+// pollwake().
+struct pollwaiter;
+
+struct pollhead {
+  struct spinlock lock;
+  struct list_head waiters;  // list of pollwaiter
+};
+
+struct pollwaiter {
+  struct list_head list;     // link in ph->waiters
+  struct pollhead *ph;       // pollhead waited on, 0 if none
+  void (*notify)(struct pollwaiter *);
+  void *arg;
+};
+
+#define EP_MAXEVENTS 32  // events returned by one epoll_wait()
@@ -16,6 +16,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthread_start(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
 
@@ -47,6 +48,7 @@ procinit(void)
   initlock(&pid_lock, "nextpid");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      initlock(&p->polllk, "polllk");
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -153,6 +155,7 @@ freeproc(struct proc *p)
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
+  p->kthread = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
@@ -240,6 +243,26 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn, which must not return.
+// The thread has no user memory and no parent.
+// Returns its pid, or -1.
+int
+kthread_create(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kthread = fn;
+  p->context.ra = (uint64)kthread_start;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -474,7 +497,7 @@ scheduler(void)
     int nproc = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state != UNUSED) {
+      if(p->state != UNUSED && !p->kthread) {
         nproc++;
       }
       if(p->state == RUNNABLE) {
@@ -557,6 +580,19 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's first scheduling switches here.
+static void
+kthread_start(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kthread();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
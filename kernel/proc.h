@@ -103,4 +103,11 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kthread)(void);       // Body of a kernel thread, else 0
+
+  // poll() and epoll_wait()
+  struct spinlock polllk;      // protects the fields below
+  int pollev;                  // a watched file signalled
+  int polltimedout;            // the wait timed out
+  struct timer *polltimer;     // timeout of the wait, if any
 };
@@ -10,78 +10,152 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "pollwait.h"
 #include "tcp.h"
 #include "fs.h"
 #include "file.h"
 
-extern struct spinlock udp_lock;
-extern struct sock *udp_sockets;
-
-// UDP used
-struct sock {
-  struct sock *next; // the next socket in the list
-  uint32 raddr;      // the remote IPv4 address
-  uint16 lport;      // the local UDP port number
-  uint16 rport;      // the remote UDP port number
-  struct spinlock lock; // protects the rxq
-  struct mbufq rxq;  // a queue of packets waiting to be received
+// Local ports, shared by TCP and UDP. A set bit means the port
+// is in use; ports outside [MIN_PORT, MAX_PORT_N) are always set.
+#define NPORTWORDS ((MAX_PORT_N + 63) / 64)
+
+// A port bound with SO_REUSEPORT is shared by a group of TCP
+// sockets that all set the option, and is free once the last of
+// them lets go of it.
+#define NREUSEPORT 16
+
+struct reuseport {
+  uint16 port;    // shared port, 0 if the slot is free
+  int users;      // sockets holding the port
 };
 
+static struct spinlock port_lock;
+static uint64 port_map[NPORTWORDS];
+static uint port_hint; // where the next automatic search starts
+static struct reuseport reuseports[NREUSEPORT];
+
+void
+port_init(void)
+{
+  uint p;
+
+  initlock(&port_lock, "port");
+  for (p = 0; p < NPORTWORDS * 64; p++)
+    if (p < MIN_PORT || p >= MAX_PORT_N)
+      port_map[p / 64] |= 1UL << (p % 64);
+  port_hint = ticks % MAX_PORT_N;
+}
+
+static void
+set_port(struct file *f, uint16 p)
+{
+  if (f && f->type == FD_SOCK_TCP)
+    f->tcpsock->sport = p;
+}
+
+// Returns the reuse group of port p, or a free slot if p is
+// not shared and free is set. Caller holds port_lock.
+static struct reuseport *
+reuseport_find(uint16 p, int free)
+{
+  struct reuseport *rp;
 
+  for (rp = reuseports; rp < reuseports + NREUSEPORT; rp++)
+    if (rp->port == p)
+      return rp;
+  if (!free)
+    return 0;
+  for (rp = reuseports; rp < reuseports + NREUSEPORT; rp++)
+    if (rp->port == 0)
+      return rp;
+  return 0;
+}
+
+// Reserves port p, returns 0 if it is already in use. A TCP
+// socket with SO_REUSEPORT joins the sockets sharing p, if all
+// of its holders set the option too.
 int
 alloc_port(struct file *f, uint16 p)
 {
+  struct reuseport *rp = 0;
+  int reuse = f && f->type == FD_SOCK_TCP && f->tcpsock->reuseport;
+
   if (p < MIN_PORT || p >= MAX_PORT_N)
     return 0;
-  acquire(&tcpsocks_list_lk);
-  acquire(&udp_lock);
-
-  int dup = 0;
-  struct tcp_sock *ts;
-  list_for_each_entry(ts, &tcpsocks_list_head, tcpsock_list) {
-    if (ts->sport == p) {
-      dup = 1;
-      break;
-    }
-  }
 
-  struct sock *pos = udp_sockets;
-  while (pos) {
-    if (pos->lport == p) {
-      dup = 1;
-      break;
+  acquire(&port_lock);
+  if (port_map[p / 64] & (1UL << (p % 64))) {
+    if (!reuse || (rp = reuseport_find(p, 0)) == 0) {
+      release(&port_lock);
+      return 0;
     }
-    pos = pos->next;
+    rp->users++;
+    release(&port_lock);
+    set_port(f, p);
+    return 1;
   }
-  if (!dup) {
-    if (f->type == FD_SOCK_TCP) {
-      f->tcpsock->sport = p;
+  if (reuse) {
+    if ((rp = reuseport_find(p, 1)) == 0) {
+      release(&port_lock);
+      return 0;
     }
+    rp->port = p;
+    rp->users = 1;
   }
-  release(&udp_lock);
-  release(&tcpsocks_list_lk);
+  port_map[p / 64] |= 1UL << (p % 64);
+  release(&port_lock);
 
-  return !dup;
+  set_port(f, p);
+  return 1;
 }
 
+// Reserves a free port, skipping 64 ports in use at a time.
 int
 auto_alloc_port(struct file *f)
 {
+  uint w, b, p;
+  uint64 avail;
+  int n;
+
+  acquire(&port_lock);
+  w = port_hint / 64;
+  for (n = 0; n <= NPORTWORDS; n++, w = (w + 1) % NPORTWORDS) {
+    avail = ~port_map[w];
+    if (!avail)
+      continue;
+    for (b = 0; !(avail & (1UL << b)); b++)
+      ;
+    p = w * 64 + b;
+    port_map[w] |= 1UL << b;
+    port_hint = p + 1 < MAX_PORT_N ? p + 1 : MIN_PORT;
+    release(&port_lock);
+
+    set_port(f, p);
+    return p;
+  }
+  release(&port_lock);
+
+  return -1;
+}
 
-  uint p = ticks % MAX_PORT_N;
-  if (p < MIN_PORT) p = MIN_PORT;
-  int cnt = 1;
-  while (!alloc_port(f, p)) {
-    p = (p + 1) % MAX_PORT_N;
-    if (p < MIN_PORT)
-      p = MIN_PORT;
-    cnt++;
-    if (cnt > MAX_PORT_N) {
-      return -1;
+void
+free_port(uint16 p)
+{
+  struct reuseport *rp;
+
+  if (p < MIN_PORT || p >= MAX_PORT_N)
+    return;
+
+  acquire(&port_lock);
+  if ((rp = reuseport_find(p, 0)) != 0) {
+    if (--rp->users > 0) {
+      release(&port_lock);
+      return;
     }
+    rp->port = 0;
   }
-
-  return p;
+  port_map[p / 64] &= ~(1UL << (p % 64));
+  release(&port_lock);
 }
 
 
@@ -89,16 +163,20 @@ int
 socket(struct file **f, int domain, int type, int protocol)
 {
 
+  int nonblock = (type & SOCK_NONBLOCK) != 0;
+
+  type &= ~SOCK_NONBLOCK;
   if (domain != AF_INET || (type != SOCK_STREAM && type != SOCK_DGRAM))
     return -1;
   
   if (type == SOCK_DGRAM) {
-    // UDP
-    // to do
+    // UDP, unbound until bind(), connect() or sendto()
+    struct sock *si = sockcreate();
+    if (!si) return -1;
     (*f)->type = FD_SOCK_UDP;
     (*f)->readable = 1;
     (*f)->writable = 1;
-    (*f)->sock = 0;
+    (*f)->sock = si;
   } else if (type == SOCK_STREAM) {
     struct tcp_sock *ts = tcp_sock_alloc();
     if (!ts) return -1;
@@ -108,6 +186,7 @@ socket(struct file **f, int domain, int type, int protocol)
     (*f)->tcpsock = ts;
 
   }
+  (*f)->nonblock = nonblock;
 
   return 0;
 }
@@ -110,6 +110,15 @@ extern uint64 sys_bind(void);
 extern uint64 sys_listen(void);
 extern uint64 sys_accept(void);
 extern uint64 sys_connect(void);
+extern uint64 sys_setsockopt(void);
+extern uint64 sys_recvfrom(void);
+extern uint64 sys_sendto(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_epoll_create(void);
+extern uint64 sys_epoll_ctl(void);
+extern uint64 sys_epoll_wait(void);
+extern uint64 sys_fcntl(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -138,7 +147,16 @@ static uint64 (*syscalls[])(void) = {
 [SYS_bind]    sys_bind,
 [SYS_listen]  sys_listen,
 [SYS_accept]  sys_accept,
-[SYS_connect] sys_connect
+[SYS_connect] sys_connect,
+[SYS_setsockopt] sys_setsockopt,
+[SYS_recvfrom] sys_recvfrom,
+[SYS_sendto]  sys_sendto,
+[SYS_sendfile] sys_sendfile,
+[SYS_poll]    sys_poll,
+[SYS_epoll_create] sys_epoll_create,
+[SYS_epoll_ctl] sys_epoll_ctl,
+[SYS_epoll_wait] sys_epoll_wait,
+[SYS_fcntl]   sys_fcntl
 };
 
 
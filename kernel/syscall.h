@@ -35,3 +35,12 @@
 #define SYS_listen 32
 #define SYS_accept 33
 #define SYS_connect 34
+#define SYS_setsockopt 35
+#define SYS_recvfrom 36
+#define SYS_sendto 37
+#define SYS_sendfile 38
+#define SYS_poll     39
+#define SYS_epoll_create 40
+#define SYS_epoll_ctl 41
+#define SYS_epoll_wait 42
+#define SYS_fcntl    43
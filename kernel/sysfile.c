@@ -18,6 +18,9 @@
 #include "list.h"
 #include "mbuf.h"
 #include "net.h"
+#include "errno.h"
+#include "poll.h"
+#include "pollwait.h"
 #include "tcp.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
@@ -344,6 +347,7 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->nonblock = (omode & O_NONBLOCK) != 0;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -506,8 +510,12 @@ sys_uconnect(void)
     return -1;
   }
 
-  if(sockalloc(&f, raddr, lport, rport) < 0)
+  if (!alloc_port(0, lport))
     return -1;
+  if(sockalloc(&f, raddr, lport, rport) < 0) {
+    free_port(lport);
+    return -1;
+  }
   if((fd=fdalloc(f)) < 0){
     fileclose(f);
     return -1;
@@ -555,11 +563,16 @@ sys_bind(void)
     return -1;
 
   struct sockaddr ksa;
-  copyin(myproc()->pagetable, (char *)&ksa, uaddr, addrlen);
+  if (addrlen > sizeof(ksa) ||
+      copyin(myproc()->pagetable, (char *)&ksa, uaddr, addrlen) < 0)
+    return -1;
   struct sockaddr_in *sin = (struct sockaddr_in *)&ksa;
   sin->sin_addr = ntohl(sin->sin_addr);
   sin->sin_port = ntohs(sin->sin_port);
 
+  if (f->type == FD_SOCK_UDP)
+    return sockbind(f->sock, sin->sin_port);
+
   return tcp_bind(f, &ksa, addrlen);
 }
 
@@ -574,21 +587,251 @@ sys_connect()
     return -1;
 
   struct sockaddr ksa;
-  copyin(myproc()->pagetable, (char *)&ksa, uaddr, addrlen);
+  if (addrlen > sizeof(ksa) ||
+      copyin(myproc()->pagetable, (char *)&ksa, uaddr, addrlen) < 0)
+    return -1;
   struct sockaddr_in *sin = (struct sockaddr_in *)&ksa;
   sin->sin_addr = ntohl(sin->sin_addr);
   sin->sin_port = ntohs(sin->sin_port);
 
-  uint16 port = auto_alloc_port(f);
-  
-  if (f->type == FD_SOCK_UDP) {
-    if(sockalloc(&f, sin->sin_addr, port, sin->sin_port) < 0)
+  if (f->type == FD_SOCK_UDP)
+    return sockconnect(f->sock, sin->sin_addr, sin->sin_port);
+  if (f->type != FD_SOCK_TCP)
+    return -1;
+
+  /* a bound socket connects from its own port */
+  int port;
+  if (f->tcpsock->sport)
+    port = f->tcpsock->sport;
+  else if ((port = auto_alloc_port(f)) < 0)
+    return -1;
+
+  return tcp_connect(f, &ksa, addrlen, port);
+}
+
+// recvfrom(fd, buf, len, flags, from, fromlen), flags is unused
+int
+sys_recvfrom(void)
+{
+  struct file *f;
+  uint64 ubuf, uaddr, ualen;
+  int len, flags, r, alen = 0;
+  uint32 raddr;
+  uint16 rport;
+
+  if (argfd(0, 0, &f) < 0 || argaddr(1, &ubuf) < 0 || argint(2, &len) < 0 ||
+      argint(3, &flags) < 0 || argaddr(4, &uaddr) < 0 || argaddr(5, &ualen) < 0)
+    return -1;
+  if (f->type != FD_SOCK_UDP)
+    return -1;
+  /* *fromlen is the size of the from buffer */
+  if (uaddr && (!ualen ||
+      copyin(myproc()->pagetable, (char *)&alen, ualen, sizeof(alen)) < 0 ||
+      alen < 0))
+    return -1;
+
+  if ((r = sockrecvfrom(f->sock, ubuf, len, f->nonblock, &raddr, &rport)) < 0)
+    return r;
+
+  if (uaddr) {
+    struct sockaddr ksa;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ksa;
+    memset(&ksa, 0, sizeof(ksa));
+    sin->sin_family = AF_INET;
+    sin->sin_addr = htonl(raddr);
+    sin->sin_port = htons(rport);
+    /* truncate to the caller's buffer, then report the real length */
+    if (alen > sizeof(ksa))
+      alen = sizeof(ksa);
+    if (copyout(myproc()->pagetable, uaddr, (char *)&ksa, alen) < 0)
+      return -1;
+    alen = sizeof(ksa);
+    if (copyout(myproc()->pagetable, ualen, (char *)&alen, sizeof(alen)) < 0)
       return -1;
-  } else if (f->type == FD_SOCK_TCP) {
-    return tcp_connect(f, &ksa, addrlen, port);
   }
 
-  return 0;
+  return r;
+}
+
+// sendto(fd, buf, len, flags, to, tolen), flags is unused
+int
+sys_sendto(void)
+{
+  struct file *f;
+  uint64 ubuf, uaddr;
+  int len, flags, addrlen;
+
+  if (argfd(0, 0, &f) < 0 || argaddr(1, &ubuf) < 0 || argint(2, &len) < 0 ||
+      argint(3, &flags) < 0 || argaddr(4, &uaddr) < 0 || argint(5, &addrlen) < 0)
+    return -1;
+  if (f->type != FD_SOCK_UDP)
+    return -1;
+
+  if (!uaddr)
+    return sockwrite(f->sock, ubuf, len);
+
+  struct sockaddr ksa;
+  if (addrlen > sizeof(ksa) ||
+      copyin(myproc()->pagetable, (char *)&ksa, uaddr, addrlen) < 0)
+    return -1;
+  struct sockaddr_in *sin = (struct sockaddr_in *)&ksa;
+
+  return socksendto(f->sock, ubuf, len, ntohl(sin->sin_addr), ntohs(sin->sin_port));
+}
+
+// sendfile(out_fd, in_fd, off, count) sends count bytes of the
+// file in_fd, starting at off, to the TCP socket out_fd. The file
+// offset of in_fd is not changed.
+int
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int off, count;
+
+  if (argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 ||
+      argint(2, &off) < 0 || argint(3, &count) < 0)
+    return -1;
+  if (out->type != FD_SOCK_TCP || !out->writable ||
+      in->type != FD_INODE || !in->readable || off < 0 || count < 0)
+    return -1;
+
+  return tcp_sendfile(out, in->ip, off, count);
+}
+
+// fcntl(fd, cmd, arg): F_GETFL returns the O_* flags of fd,
+// F_SETFL sets or clears its O_NONBLOCK.
+int
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg, flags;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0)
+    return -1;
+
+  switch(cmd){
+  case F_GETFL:
+    if(f->readable && f->writable)
+      flags = O_RDWR;
+    else if(f->writable)
+      flags = O_WRONLY;
+    else
+      flags = O_RDONLY;
+    if(f->nonblock)
+      flags |= O_NONBLOCK;
+    return flags;
+  case F_SETFL:
+    f->nonblock = (arg & O_NONBLOCK) != 0;
+    return 0;
+  }
+  return -1;
+}
+
+int
+sys_poll(void)
+{
+  struct pollfd fds[NOFILE];
+  uint64 ufds;
+  int nfds, timeout, n;
+  pagetable_t pt = myproc()->pagetable;
+
+  if (argaddr(0, &ufds) < 0 || argint(1, &nfds) < 0 || argint(2, &timeout) < 0)
+    return -1;
+  if (nfds < 0 || nfds > NOFILE)
+    return -1;
+  if (copyin(pt, (char *)fds, ufds, nfds * sizeof(fds[0])) < 0)
+    return -1;
+
+  n = pollfds(fds, nfds, timeout);
+  if (n < 0 || copyout(pt, ufds, (char *)fds, nfds * sizeof(fds[0])) < 0)
+    return -1;
+  return n;
+}
+
+int
+sys_epoll_create(void)
+{
+  struct file *f;
+  struct eventpoll *ep;
+  int fd;
+
+  if ((f = filealloc()) == 0)
+    return -1;
+  if ((ep = epollalloc()) == 0) {
+    fileclose(f);
+    return -1;
+  }
+  f->type = FD_EPOLL;
+  f->readable = 0;
+  f->writable = 0;
+  f->ep = ep;
+  if ((fd = fdalloc(f)) < 0) {
+    fileclose(f);
+    return -1;
+  }
+  return fd;
+}
+
+int
+sys_epoll_ctl(void)
+{
+  struct file *epf, *f;
+  struct epoll_event ev;
+  uint64 uev;
+  int op;
+
+  if (argfd(0, 0, &epf) < 0 || argint(1, &op) < 0 || argfd(2, 0, &f) < 0 ||
+      argaddr(3, &uev) < 0)
+    return -1;
+  if (epf->type != FD_EPOLL)
+    return -1;
+  if (op != EPOLL_CTL_DEL &&
+      copyin(myproc()->pagetable, (char *)&ev, uev, sizeof(ev)) < 0)
+    return -1;
+
+  return epollctl(epf->ep, op, f, &ev);
+}
+
+int
+sys_epoll_wait(void)
+{
+  struct epoll_event evs[EP_MAXEVENTS];
+  struct file *epf;
+  uint64 uevs;
+  int max, timeout, n;
+
+  if (argfd(0, 0, &epf) < 0 || argaddr(1, &uevs) < 0 ||
+      argint(2, &max) < 0 || argint(3, &timeout) < 0)
+    return -1;
+  if (epf->type != FD_EPOLL || max <= 0)
+    return -1;
+
+  n = epollwait(epf->ep, evs, max, timeout);
+  if (n > 0 &&
+      copyout(myproc()->pagetable, uevs, (char *)evs, n * sizeof(evs[0])) < 0)
+    return -1;
+  return n;
+}
+
+int
+sys_setsockopt(void)
+{
+  struct file *f;
+  int level, optname, optlen, val;
+  uint64 optval;
+
+  if (argfd(0, 0, &f) < 0 || argint(1, &level) < 0 || argint(2, &optname) < 0 ||
+      argaddr(3, &optval) < 0 || argint(4, &optlen) < 0)
+    return -1;
+
+  if (optlen < sizeof(val) ||
+      copyin(myproc()->pagetable, (char *)&val, optval, sizeof(val)) < 0)
+    return -1;
+
+  if (f->type == FD_SOCK_TCP && (level == IPPROTO_TCP || level == SOL_SOCKET))
+    return tcp_setsockopt(f, level, optname, val);
+
+  return -1;
 }
 
 int
@@ -613,8 +856,13 @@ sys_accept(void)
 
   if (argfd(0, 0, &f) < 0 || argaddr(1, &uaddr) < 0 || argaddr(2, &addrlen) < 0)
     return -1;
+  if (f->type != FD_SOCK_TCP)
+    return -1;
 
-  struct tcp_sock *newts = tcp_accept(f);
+  struct tcp_sock *newts;
+  int r;
+  if ((r = tcp_accept(f, &newts)) < 0)
+    return r;
 
   if (uaddr && addrlen > 0) {
     struct sockaddr ksa;
@@ -15,98 +15,188 @@
 #include "list.h"
 #include "mbuf.h"
 #include "net.h"
+#include "errno.h"
+#include "poll.h"
+#include "pollwait.h"
+
+#define UDP_HASH_SIZE 64 // a power of two
 
 // UDP used
 struct sock {
-  struct sock *next; // the next socket in the list
-  uint32 raddr;      // the remote IPv4 address
-  uint16 lport;      // the local UDP port number
-  uint16 rport;      // the remote UDP port number
+  struct sock *next; // the next socket in the hash chain
+  uint32 raddr;      // the remote IPv4 address, 0 if not connected
+  uint16 lport;      // the local UDP port number, 0 if not bound
+  uint16 rport;      // the remote UDP port number, 0 if not connected
   struct spinlock lock; // protects the rxq
   struct mbufq rxq;  // a queue of packets waiting to be received
+  struct pollhead ph;   // poll() and epoll waiters
+};
+
+// Bound sockets, hashed by local port. A local port belongs to
+// one socket (see alloc_port()), so a datagram goes to the socket
+// bound to its destination port. A connected socket only accepts
+// datagrams from its peer.
+struct udp_hbucket {
+  struct spinlock lock;
+  struct sock *head;
 };
 
-struct spinlock udp_lock;
-struct sock *udp_sockets;
+static struct udp_hbucket udp_hash[UDP_HASH_SIZE];
+static struct kmem_cache *sock_cache;
 
-struct spinlock tcpsocks_list_lk;
-struct list_head tcpsocks_list_head;
+static struct udp_hbucket *
+udp_bucket(uint16 lport)
+{
+  return &udp_hash[lport & (UDP_HASH_SIZE - 1)];
+}
 
 void
 sockinit(void)
 {
-  initlock(&udp_lock, "socktbl");
+  int i;
+
+  for (i = 0; i < UDP_HASH_SIZE; i++)
+    initlock(&udp_hash[i].lock, "udp_hash");
+  sock_cache = kmem_cache_create("sock", sizeof(struct sock), 0);
+
+  port_init();
+  tcp_init();
+}
+
+static void
+sockhash(struct sock *si)
+{
+  struct udp_hbucket *hb = udp_bucket(si->lport);
+
+  acquire(&hb->lock);
+  si->next = hb->head;
+  hb->head = si;
+  release(&hb->lock);
+}
+
+static void
+sockunhash(struct sock *si)
+{
+  struct udp_hbucket *hb = udp_bucket(si->lport);
+  struct sock **pos;
 
-  initlock(&tcpsocks_list_lk, "tcpsocks_list_lk");
-  list_init(&tcpsocks_list_head);
-  
+  acquire(&hb->lock);
+  pos = &hb->head;
+  while (*pos) {
+    if (*pos == si){
+      *pos = si->next;
+      break;
+    }
+    pos = &(*pos)->next;
+  }
+  release(&hb->lock);
 }
 
+// Allocates an unbound, unconnected socket.
+struct sock *
+sockcreate(void)
+{
+  struct sock *si;
+
+  if ((si = kmem_cache_alloc(sock_cache)) == 0)
+    return 0;
+  memset(si, 0, sizeof(*si));
+  initlock(&si->lock, "sock");
+  mbufq_init(&si->rxq);
+  pollhead_init(&si->ph);
+  return si;
+}
+
+// Allocates a connected socket on lport, which the caller has
+// already reserved.
 int
 sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
 {
-  struct sock *si, *pos;
+  struct sock *si;
 
   si = 0;
   *f = 0;
   if ((*f = filealloc()) == 0)
     goto bad;
-  if ((si = (struct sock*)kalloc()) == 0)
+  if ((si = sockcreate()) == 0)
     goto bad;
 
   // initialize objects
   si->raddr = raddr;
   si->lport = lport;
   si->rport = rport;
-  initlock(&si->lock, "sock");
-  mbufq_init(&si->rxq);
   (*f)->type = FD_SOCK_UDP;
   (*f)->readable = 1;
   (*f)->writable = 1;
   (*f)->sock = si;
 
-  // add to list of sockets
-  acquire(&udp_lock);
-  pos = udp_sockets;
-  while (pos) {
-    if (pos->raddr == raddr &&
-        pos->lport == lport &&
-	pos->rport == rport) {
-      release(&udp_lock);
-      goto bad;
-    }
-    pos = pos->next;
-  }
-  si->next = udp_sockets;
-  udp_sockets = si;
-  release(&udp_lock);
+  sockhash(si);
   return 0;
 
 bad:
   if (si)
-    kfree((char*)si);
+    kmem_cache_free(sock_cache, si);
   if (*f)
     fileclose(*f);
   return -1;
 }
 
+int
+sockbind(struct sock *si, uint16 lport)
+{
+  if (si->lport || !alloc_port(0, lport))
+    return -1;
+
+  si->lport = lport;
+  sockhash(si);
+  return 0;
+}
+
+// Binds si to a free port if it is not bound yet.
+static int
+sockautobind(struct sock *si)
+{
+  int port;
+
+  if (si->lport)
+    return 0;
+  if ((port = auto_alloc_port(0)) < 0)
+    return -1;
+
+  si->lport = port;
+  sockhash(si);
+  return 0;
+}
+
+int
+sockconnect(struct sock *si, uint32 raddr, uint16 rport)
+{
+  struct udp_hbucket *hb;
+
+  if (sockautobind(si) < 0)
+    return -1;
+
+  hb = udp_bucket(si->lport);
+  acquire(&hb->lock);
+  si->raddr = raddr;
+  si->rport = rport;
+  release(&hb->lock);
+  return 0;
+}
+
 void
 sockclose(struct sock *si)
 {
-  struct sock **pos;
   struct mbuf *m;
 
-  // remove from list of sockets
-  acquire(&udp_lock);
-  pos = &udp_sockets;
-  while (*pos) {
-    if (*pos == si){
-      *pos = si->next;
-      break;
-    }
-    pos = &(*pos)->next;
+  if (!si)
+    return;
+
+  // remove from the hash table
+  if (si->lport) {
+    sockunhash(si);
+    free_port(si->lport);
   }
-  release(&udp_lock);
 
   // free any pending mbufs
   while (!mbufq_empty(&si->rxq)) {
@@ -114,18 +204,28 @@ sockclose(struct sock *si)
     mbuffree(m);
   }
 
-  kfree((char*)si);
+  kmem_cache_free(sock_cache, si);
 }
 
+// Receives one datagram and reports its sender. If nonblock is
+// set and none is queued, returns -EAGAIN instead of sleeping.
 int
-sockread(struct sock *si, uint64 addr, int n)
+sockrecvfrom(struct sock *si, uint64 addr, int n, int nonblock,
+             uint32 *raddr, uint16 *rport)
 {
   struct proc *pr = myproc();
   struct mbuf *m;
   int len;
 
+  if (!si->lport)
+    return -1;
+
   acquire(&si->lock);
   while (mbufq_empty(&si->rxq) && !pr->killed) {
+    if (nonblock) {
+      release(&si->lock);
+      return -EAGAIN;
+    }
     sleep(&si->rxq, &si->lock);
   }
   if (pr->killed) {
@@ -135,6 +235,11 @@ sockread(struct sock *si, uint64 addr, int n)
   m = mbufq_pophead(&si->rxq);
   release(&si->lock);
 
+  if (raddr)
+    *raddr = m->raddr;
+  if (rport)
+    *rport = m->rport;
+
   len = m->len;
   if (len > n)
     len = n;
@@ -146,12 +251,40 @@ sockread(struct sock *si, uint64 addr, int n)
   return len;
 }
 
+// A UDP socket is readable while a datagram is queued, and
+// always writable.
 int
-sockwrite(struct sock *si, uint64 addr, int n)
+sockpoll(struct sock *si, struct pollhead **ph)
+{
+  int mask = POLLOUT;
+
+  if (ph)
+    *ph = &si->ph;
+  acquire(&si->lock);
+  if (!mbufq_empty(&si->rxq))
+    mask |= POLLIN;
+  release(&si->lock);
+  return mask;
+}
+
+int
+sockread(struct sock *si, uint64 addr, int n, int nonblock)
+{
+  return sockrecvfrom(si, addr, n, nonblock, 0, 0);
+}
+
+// Sends one datagram to raddr:rport, binding si first if needed.
+int
+socksendto(struct sock *si, uint64 addr, int n, uint32 raddr, uint16 rport)
 {
   struct proc *pr = myproc();
   struct mbuf *m;
 
+  if (n < 0 || n > MBUF_SIZE - MBUF_DEFAULT_HEADROOM)
+    return -1;
+  if (sockautobind(si) < 0)
+    return -1;
+
   m = mbufalloc(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return -1;
@@ -160,10 +293,18 @@ sockwrite(struct sock *si, uint64 addr, int n)
     mbuffree(m);
     return -1;
   }
-  net_tx_udp(m, si->raddr, si->lport, si->rport);
+  net_tx_udp(m, raddr, si->lport, rport);
   return n;
 }
 
+int
+sockwrite(struct sock *si, uint64 addr, int n)
+{
+  if (!si->rport)
+    return -1;
+  return socksendto(si, addr, n, si->raddr, si->rport);
+}
+
 // called by protocol handler layer to deliver UDP packets
 void
 sockrecvudp(struct mbuf *m, uint32 raddr, uint16 lport, uint16 rport)
@@ -173,23 +314,28 @@ sockrecvudp(struct mbuf *m, uint32 raddr, uint16 lport, uint16 rport)
   // any sleeping reader. Free the mbuf if there are no sockets
   // registered to handle it.
   //
+  struct udp_hbucket *hb = udp_bucket(lport);
   struct sock *si;
 
-  acquire(&udp_lock);
-  si = udp_sockets;
-  while (si) {
-    if (si->raddr == raddr && si->lport == lport && si->rport == rport)
-      goto found;
-    si = si->next;
+  acquire(&hb->lock);
+  for (si = hb->head; si; si = si->next) {
+    if (si->lport != lport)
+      continue;
+    if (si->rport && (si->raddr != raddr || si->rport != rport))
+      break;
+    goto found;
   }
-  release(&udp_lock);
+  release(&hb->lock);
   mbuffree(m);
   return;
 
 found:
+  m->raddr = raddr;
+  m->rport = rport;
   acquire(&si->lock);
   mbufq_pushtail(&si->rxq, m);
   wakeup(&si->rxq);
+  pollwake(&si->ph);
   release(&si->lock);
-  release(&udp_lock);
+  release(&hb->lock);
 }
@@ -10,6 +10,7 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "pollwait.h"
 #include "tcp.h"
 
 void tcp_dump(struct tcp_hdr *tcphdr, struct mbuf *m)
@@ -86,45 +87,156 @@ void tcp_init_segment(struct tcp_hdr *tcphdr, struct mbuf *m)
 }
 
 
+/*
+ * Connection demultiplexing. Sockets with a known remote end are
+ * hashed by 4-tuple, listeners by local port. Each bucket has its
+ * own lock, so lookups for different connections do not contend.
+ * The local address is always local_ip and is left out of the hash.
+ */
+static struct tcp_hbucket tcp_ehash[TCP_EHASH_SIZE];
+static struct tcp_hbucket tcp_lhash[TCP_LHASH_SIZE];
+
+static _inline uint32
+tcp_hashfn(uint32 raddr, uint16 rport, uint16 lport)
+{
+  uint32 h = raddr ^ ((uint32)rport << 16 | lport);
+
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+static _inline uint
+tcp_ehashfn(uint32 raddr, uint16 rport, uint16 lport)
+{
+  return tcp_hashfn(raddr, rport, lport) & (TCP_EHASH_SIZE - 1);
+}
+
+static _inline uint
+tcp_lhashfn(uint16 lport)
+{
+  return lport & (TCP_LHASH_SIZE - 1);
+}
+
+struct kmem_cache *tcp_sock_cache;
+
+void
+tcp_init(void)
+{
+  int i;
+
+  tcp_sock_cache = kmem_cache_create("tcp_sock", sizeof(struct tcp_sock), 0);
+  tcp_syncookie_init();
+
+  for (i = 0; i < TCP_EHASH_SIZE; i++) {
+    initlock(&tcp_ehash[i].lock, "tcp_ehash");
+    list_init(&tcp_ehash[i].head);
+  }
+  for (i = 0; i < TCP_LHASH_SIZE; i++) {
+    initlock(&tcp_lhash[i].lock, "tcp_lhash");
+    list_init(&tcp_lhash[i].head);
+  }
+}
+
+static void
+tcp_hash_add(struct tcp_sock *ts, struct tcp_hbucket *hb)
+{
+  acquire(&hb->lock);
+  list_add(&ts->hash_list, &hb->head);
+  ts->hbucket = hb;
+  release(&hb->lock);
+}
+
+// Hashes a socket whose 4-tuple is complete.
+void
+tcp_hash_established(struct tcp_sock *ts)
+{
+  tcp_unhash(ts);
+  tcp_hash_add(ts, &tcp_ehash[tcp_ehashfn(ts->daddr, ts->dport, ts->sport)]);
+}
+
+void
+tcp_hash_listen(struct tcp_sock *ts)
+{
+  tcp_unhash(ts);
+  tcp_hash_add(ts, &tcp_lhash[tcp_lhashfn(ts->sport)]);
+}
+
+void
+tcp_unhash(struct tcp_sock *ts)
+{
+  struct tcp_hbucket *hb = ts->hbucket;
+
+  if (!hb)
+    return;
+  acquire(&hb->lock);
+  list_del(&ts->hash_list);
+  ts->hbucket = NULL;
+  release(&hb->lock);
+}
+
 struct tcp_sock *
 tcp_sock_lookup_establish(uint src, uint dst, uint16 sport, uint16 dport)
 {
+  struct tcp_hbucket *hb = &tcp_ehash[tcp_ehashfn(src, sport, dport)];
   struct tcp_sock *tcpsock = NULL, *s;
-  acquire(&tcpsocks_list_lk);
+  acquire(&hb->lock);
   
-  list_for_each_entry(s, &tcpsocks_list_head, tcpsock_list) {
-    // tcpdbg("s->sport: %d   s->dport: %d\n", s->sport, s->dport);
+  list_for_each_entry(s, &hb->head, hash_list) {
     if (src == s->daddr && sport == s->dport && dport == s->sport) {
       tcpsock = s;
-      // tcpdbg("find establish\n");
       break;
     }
   }
+  if (tcpsock)
+    tcp_sock_hold(tcpsock);
 
-  release(&tcpsocks_list_lk);
+  release(&hb->lock);
 
   return tcpsock;
 }
 
 
+// Finds the listener for a segment from src:sport to port dport.
+// Several SO_REUSEPORT listeners may share dport; the 4-tuple
+// picks one of them, so each connection stays with the listener
+// that saw its SYN, and listeners get their own share to accept.
 struct tcp_sock *
-tcp_sock_lookup_listen(uint dst, uint16 dport)
+tcp_sock_lookup_listen(uint src, uint16 sport, uint16 dport)
 {
+  struct tcp_hbucket *hb = &tcp_lhash[tcp_lhashfn(dport)];
   struct tcp_sock *tcpsock = NULL, *s;
-  acquire(&tcpsocks_list_lk);
+  uint n = 0, pick;
+  acquire(&hb->lock);
   
-  list_for_each_entry(s, &tcpsocks_list_head, tcpsock_list) {
+  list_for_each_entry(s, &hb->head, hash_list) {
     if (dport == s->sport && s->state == TCP_LISTEN) {
       tcpsock = s;
-      break;
+      n++;
+      if (!s->reuseport)
+        break;
     }
   }
 
-  release(&tcpsocks_list_lk);
+  if (n > 1) {
+    pick = tcp_hashfn(src, sport, dport) % n;
+    list_for_each_entry(s, &hb->head, hash_list) {
+      if (dport == s->sport && s->state == TCP_LISTEN && pick-- == 0) {
+        tcpsock = s;
+        break;
+      }
+    }
+  }
+  if (tcpsock)
+    tcp_sock_hold(tcpsock);
+
+  release(&hb->lock);
 
   return tcpsock;
 }
 
+// The returned socket holds a reference, dropped with tcp_sock_put().
 struct tcp_sock *
 tcp_sock_lookup(uint src, uint dst, uint16 sport, uint16 dport)
 {
@@ -132,7 +244,7 @@ tcp_sock_lookup(uint src, uint dst, uint16 sport, uint16 dport)
   tcpdbg("look: sport: %d, dport: %d\n", sport, dport);
   tcpsock = tcp_sock_lookup_establish(src, dst, sport, dport);
   if (!tcpsock)
-    tcpsock = tcp_sock_lookup_listen(dst, dport);
+    tcpsock = tcp_sock_lookup_listen(src, sport, dport);
 
   return tcpsock;
 }
@@ -140,36 +252,116 @@ tcp_sock_lookup(uint src, uint dst, uint16 sport, uint16 dport)
 void
 tcp_free(struct tcp_sock *ts)
 {
-  acquire(&tcpsocks_list_lk);
-  list_del(&ts->tcpsock_list);
-  release(&tcpsocks_list_lk);
+  tcp_unhash(ts);
+  /* children share the port of their listener */
+  if (!ts->parent && ts->sport)
+    free_port(ts->sport);
 
   // clear timer
+  tcp_clear_retransmit_timer(ts);
+  if (ts->timewait) {
+    tcp_timer_cancel(ts, ts->timewait);
+    ts->timewait = NULL;
+  }
+  if (ts->delack) {
+    tcp_timer_cancel(ts, ts->delack);
+    ts->delack = NULL;
+  }
   // clear queue
   mbuf_queue_free(&ts->ofo_queue);
   mbuf_queue_free(&ts->rcv_queue);
   mbuf_queue_free(&ts->write_queue);
+  mbuf_queue_free(&ts->snd_queue);
 }
 
-void 
-tcp_sock_free(struct tcp_sock *ts)
+void
+tcp_sock_hold(struct tcp_sock *ts)
+{
+  __sync_fetch_and_add(&ts->refcnt, 1);
+}
+
+// A child holds a reference on its listener, so whoever holds
+// the child may lock ts->parent.
+void
+tcp_sock_put(struct tcp_sock *ts)
+{
+  struct tcp_sock *parent;
+
+  if (__sync_sub_and_fetch(&ts->refcnt, 1) == 0) {
+    parent = ts->parent;
+    kmem_cache_free(tcp_sock_cache, ts);
+    if (parent)
+      tcp_sock_put(parent);
+  }
+}
+
+// Locks ts. An embryonic connection moves itself on and off the
+// queues of its listener, so the listener is locked first, as
+// tcp_clear_listen_queue() does. A connection never goes back to
+// SYN-RECEIVED, so the unlocked check errs only on the safe side.
+// Returns the listener that was locked, for tcp_sock_unlock().
+struct tcp_sock *
+tcp_sock_lock(struct tcp_sock *ts)
+{
+  struct tcp_sock *parent = NULL;
+
+  if (ts->parent && ts->state == TCP_SYN_RECEIVED) {
+    parent = ts->parent;
+    acquire(&parent->spinlk);
+  }
+  acquire(&ts->spinlk);
+  return parent;
+}
+
+void
+tcp_sock_unlock(struct tcp_sock *ts, struct tcp_sock *parent)
+{
+  release(&ts->spinlk);
+  if (parent)
+    release(&parent->spinlk);
+}
+
+// Arms a timer whose handler gets ts as its argument. The timer
+// holds a reference on ts, which the handler drops when it is done,
+// so a handler that already fired never sees ts freed under it.
+struct timer *
+tcp_timer_add(struct tcp_sock *ts, uint32 expire, void *(*handler)(void *))
 {
-  kfree(ts);
+  struct timer *t;
+
+  tcp_sock_hold(ts);
+  if ((t = timer_add(expire, handler, ts)) == 0)
+    tcp_sock_put(ts);
+  return t;
 }
 
+// Drops the timer's reference on ts, unless the handler has been
+// started and will drop it itself.
+void
+tcp_timer_cancel(struct tcp_sock *ts, struct timer *t)
+{
+  if (timer_cancel(t))
+    tcp_sock_put(ts);
+}
+
+// Releases the socket and drops the owner's reference. Timer
+// handlers and incoming segments may race to close the same
+// socket; only the first one does.
 void 
 tcp_done(struct tcp_sock *ts)
 {
+  if (__sync_lock_test_and_set(&ts->dead, 1))
+    return;
   tcp_set_state(ts, TCP_CLOSE);
   tcp_free(ts);
-  tcp_sock_free(ts);
+  tcp_sock_put(ts);
   tcpdbg("tcp done !!!\n");
 }
 
 struct tcp_sock *
 get_test_tcpsock(uint16 sport, uint16 dport)
 {
-  struct tcp_sock *tcpsock = (struct tcp_sock *)kalloc();
+  struct tcp_sock *tcpsock = kmem_cache_alloc(tcp_sock_cache);
   mbuf_queue_init(&tcpsock->rcv_queue);
   mbuf_queue_init(&tcpsock->write_queue);
   tcpsock->state = TCP_LISTEN;
@@ -179,18 +371,93 @@ get_test_tcpsock(uint16 sport, uint16 dport)
   return tcpsock;
 }
 
+static uint32
+tcp_opt_get32(uint8 *p)
+{
+  return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+static void
+tcp_parse_options(struct tcp_hdr *th, uint8 *opt, int len, struct tcp_options *opts)
+{
+  int i;
+
+  memset(opts, 0, sizeof(*opts));
+
+  while (len > 0) {
+    if (opt[0] == TCPOPT_EOL)
+      break;
+    if (opt[0] == TCPOPT_NOP) {
+      opt++;
+      len--;
+      continue;
+    }
+    /* malformed option, ignore the rest */
+    if (len < 2 || opt[1] < 2 || opt[1] > len)
+      break;
+
+    switch (opt[0]) {
+    case TCPOPT_MSS:
+      /* RFC 793: only in segments with SYN set */
+      if (th->syn && opt[1] == TCPOLEN_MSS)
+        opts->mss = (opt[2] << 8) | opt[3];
+      break;
+    case TCPOPT_WINDOW:
+      if (th->syn && opt[1] == TCPOLEN_WINDOW) {
+        opts->wscale_ok = 1;
+        opts->wscale = opt[2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : opt[2];
+      }
+      break;
+    case TCPOPT_SACK_PERM:
+      if (th->syn && opt[1] == TCPOLEN_SACK_PERM)
+        opts->sack_ok = 1;
+      break;
+    case TCPOPT_SACK:
+      if ((opt[1] - TCPOLEN_SACK_BASE) % TCPOLEN_SACK_PERBLOCK)
+        break;
+      for (i = TCPOLEN_SACK_BASE; i < opt[1] && opts->nr_sacks < TCP_MAX_SACKS;
+           i += TCPOLEN_SACK_PERBLOCK) {
+        opts->sacks[opts->nr_sacks].start = tcp_opt_get32(opt + i);
+        opts->sacks[opts->nr_sacks].end = tcp_opt_get32(opt + i + 4);
+        opts->nr_sacks++;
+      }
+      break;
+    }
+
+    len -= opt[1];
+    opt += opt[1];
+  }
+}
+
 // iphdr is network bytes order
 void net_rx_tcp(struct mbuf *m, uint16 len, struct ip *iphdr)
 {
   struct tcp_hdr *tcphdr;
+  struct tcp_options opts;
+  int optlen;
+
+  // validate the checksum, unless the e1000 did
+  if ((m->csum & MBUF_CSUM_L4_BAD) ||
+      (!(m->csum & MBUF_CSUM_L4_OK) &&
+       tcp_v4_checksum(m, iphdr->ip_src, iphdr->ip_dst) != 0)) {
+    mbuffree(m);
+    return;
+  }
 
   tcphdr = mbufpullhdr(m, *tcphdr);
-  // ignore tcp options
-  if (tcphdr->doff > TCP_MIN_DATA_OFF)
-  {
-    m->head += (tcphdr->doff - TCP_MIN_DATA_OFF) * 4;
-    m->len -= (tcphdr->doff - TCP_MIN_DATA_OFF) * 4;
+  if (!tcphdr || tcphdr->doff < TCP_MIN_DATA_OFF) {
+    mbuffree(m);
+    return;
+  }
+
+  optlen = (tcphdr->doff - TCP_MIN_DATA_OFF) * 4;
+  if (optlen > m->len) {
+    mbuffree(m);
+    return;
   }
+  tcp_parse_options(tcphdr, (uint8 *)m->head, optlen, &opts);
+  m->head += optlen;
+  m->len -= optlen;
 
   tcp_init_segment(tcphdr, m);
 
@@ -217,10 +484,19 @@ void net_rx_tcp(struct mbuf *m, uint16 len, struct ip *iphdr)
   //     return;
   // }
 
-  acquire(&tcpsock->spinlk);
+  struct tcp_sock *parent = tcp_sock_lock(tcpsock);
+  /* closed by its listener or a timer since it was looked up */
+  if (tcpsock->dead) {
+    tcp_sock_unlock(tcpsock, parent);
+    tcp_sock_put(tcpsock);
+    mbuffree(m);
+    return;
+  }
   tcpdbg("***************************\n");
-  int r = tcp_input_state(tcpsock, tcphdr, iphdr, m);
+  int r = tcp_input_state(tcpsock, tcphdr, iphdr, m, &opts);
   tcpdbg("***************************\n");
   if (!r) release(&tcpsock->spinlk);
+  if (parent) release(&parent->spinlk);
+  tcp_sock_put(tcpsock);
 
 }
@@ -1,15 +1,32 @@
 #define TCP_MIN_DATA_OFF 5
 
-extern struct spinlock tcpsocks_list_lk;
-extern struct list_head tcpsocks_list_head;
-
-#define TCP_DEFAULT_WINDOW	40960
+#define TCP_DEFAULT_WINDOW	131072
+#define TCP_DEFAULT_SNDBUF	32768
 #define TCP_MAX_BACKLOG		128
-#define TCP_DEFALUT_MSS 536
+#define TCP_DEFALUT_MSS 536 /* RFC 1122: assumed when the peer sends no MSS option */
+#define TCP_MSS 1460        /* Ethernet MTU 1500 - IP header - TCP header */
+#define TCP_GSO_MAX_SIZE (0xffff - 20 - 60) /* data in a 64KB super-segment */
 
 #define TCP_HDR_LEN sizeof(struct tcp_hdr)
 #define TCP_DOFFSET sizeof(struct tcp_hdr) / 4
 
+/* TCP options */
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+#define TCPOPT_WINDOW 3     /* RFC 7323 window scale */
+#define TCPOPT_SACK_PERM 4  /* RFC 2018 SACK permitted */
+#define TCPOPT_SACK 5       /* RFC 2018 SACK blocks */
+
+#define TCPOLEN_MSS 4
+#define TCPOLEN_WINDOW 3
+#define TCPOLEN_SACK_PERM 2
+#define TCPOLEN_SACK_BASE 2
+#define TCPOLEN_SACK_PERBLOCK 8
+
+#define TCP_MAX_WSCALE 14
+#define TCP_MAX_SACKS 4
+
 #define TCP_FIN 0x01
 #define TCP_SYN 0x02
 #define TCP_RST 0x04
@@ -19,6 +36,39 @@ extern struct list_head tcpsocks_list_head;
 #define TCP_MSL			100		/* 10sec */
 #define TCP_TIMEWAIT_TIMEOUT	(2 * TCP_MSL)	/* 2MSL */
 
+/* RFC 6298 retransmission timeout, in timer ticks (100ms) */
+#define TCP_RTO_INIT		10		/* 1sec */
+#define TCP_RTO_MIN		2		/* 200ms */
+#define TCP_RTO_MAX		600		/* 60sec */
+#define TCP_MAX_RETRIES		8
+
+/* RFC 1122 4.2.3.2: delay an ACK by less than 0.5sec */
+#define TCP_DELACK_TIMEOUT	2		/* 200ms */
+
+/* connection demultiplexing, sizes are powers of two */
+#define TCP_EHASH_SIZE		256		/* by 4-tuple */
+#define TCP_LHASH_SIZE		32		/* listeners, by port */
+
+/* accept SYN cookies this long after the SYN queue overflowed */
+#define TCP_SYNCOOKIE_VALID	1200		/* 2min */
+
+#define TCP_DUPACK_THRESH	3
+#define TCP_INFINITE_SSTHRESH	0x7fffffff
+
+struct tcp_sock;
+
+/*
+ * Congestion control algorithm. Loss detection and recovery
+ * (RFC 6582 NewReno) live in tcp_cong.c, an algorithm only
+ * decides how cwnd grows and how far it backs off.
+ */
+struct tcp_cong_ops {
+  char *name;
+  void (*init)(struct tcp_sock *ts);                      // optional
+  uint32 (*ssthresh)(struct tcp_sock *ts);                // new ssthresh after a loss
+  void (*cong_avoid)(struct tcp_sock *ts, uint32 acked);  // grow cwnd on a new ACK
+};
+
 struct tcp_hdr {
   uint16 sport;      // source port
   uint16 dport;      // destination port
@@ -39,6 +89,21 @@ struct tcp_hdr {
   uint16 urgptr; // urgent pointer(if URG set)
 };
 
+struct tcp_sack_block {
+  uint32 start; // first sequence number of the block
+  uint32 end;   // sequence number after the block
+};
+
+// options parsed from a received segment
+struct tcp_options {
+  uint16 mss;      // 0 if the segment carries no MSS option
+  uint8 wscale_ok; // window scale option present
+  uint8 wscale;    // peer's window shift count
+  uint8 sack_ok;   // SACK permitted option present
+  int nr_sacks;    // number of SACK blocks
+  struct tcp_sack_block sacks[TCP_MAX_SACKS];
+};
+
 enum tcp_states {
   TCP_LISTEN,       /* represents waiting for a connection request from any remote
                    TCP and port. */
@@ -79,6 +144,10 @@ struct tcb {
   uint32 snd_wl2; // segment acknowledgment number used for last window update
   uint32 iss;     // initial send sequence number
 
+  // Congestion Control Variables (RFC 5681)
+  uint32 cwnd;     // congestion window
+  uint32 ssthresh; // slow start threshold
+
   // Receive Sequence Variables
   uint32 rcv_nxt; // receive next
   uint32 rcv_wnd; // receive window
@@ -86,16 +155,24 @@ struct tcb {
   uint32 irs;     // initial receive sequence number
 };
 
+struct tcp_hbucket {
+  struct spinlock lock;
+  struct list_head head;
+};
+
 struct tcp_sock {
-  struct list_head tcpsock_list;   // link tcpsocks_list_head
+  struct list_head hash_list;    // link a bucket of the established or listen hash
+  struct tcp_hbucket *hbucket;   // bucket the socket is hashed in, if any
 
   uint32 saddr; // the local IPv4 address
   uint32 daddr; // the remote IPv4 address
   uint16 sport; // the local TCP port number
   uint16 dport; // the remote TCP port number
 
-  int backlog;                   // size of connection queue
+  int backlog;                   // limit of listen_queue and of accept_queue
+  int syn_backlog;               // current entries of listen queue
   int accept_backlog;            // current entries of accept queue
+  uint32 synq_overflow;          // ticks when listen_queue last overflowed, 0 if never
   struct list_head listen_queue; // waiting for second SYN+ACK of three-way handshake.(SYN_RECVD)
   struct list_head accept_queue; // waiting for accept.(ESTABLISHED)
   struct list_head list;         // link listen_queue / accept_queue
@@ -103,17 +180,64 @@ struct tcp_sock {
   uint wait_connect;
   uint wait_accept;   // sleep-wakeup condition
   uint wait_rcv;
+  uint wait_snd;      // wait for send buffer space
+  int err;            // E* error that closed the connection, reported by connect()
+  struct pollhead ph; // poll() and epoll waiters, woken with the above
 
   struct tcp_sock *parent; // parent socket
   struct tcb tcb;          // Transmission Control Block
   uint state;              // tcp state
   uint flags;              // tcp flags
+  uint16 mss;              // maximum segment size we send
+  uint8 wscale_ok;         // both sides agreed on window scaling
+  uint8 snd_wscale;        // shift count of the peer's window
+  uint8 rcv_wscale;        // shift count of our window
+  uint8 sack_ok;           // both sides agreed on SACK
 
   struct mbuf_queue ofo_queue; // Out-of-order queue
 
   struct mbuf_queue rcv_queue; // receive queue
+  uint32 rcv_queued;           // bytes in rcv_queue and ofo_queue
+  uint32 rcvbuf;               // limit of rcv_queued, the largest window we offer
+
+  struct mbuf_queue write_queue; // write queue, sent but unacknowledged segments
+
+  struct mbuf_queue snd_queue;   // send buffer, data not yet sent
+  uint32 snd_queued;             // bytes in snd_queue
+  uint32 sndbuf;                 // limit of unsent plus unacknowledged bytes
+  int snd_fin;                   // send FIN after snd_queue drains
+  int nodelay;                   // TCP_NODELAY
+  int cork;                      // TCP_CORK
+  int reuseport;                 // SO_REUSEPORT
 
-  struct mbuf_queue write_queue; // write queue
+  // RFC 6298 round-trip time estimation, in timer ticks
+  int srtt;              // smoothed round-trip time, scaled by 8
+  int rttvar;            // round-trip time variation, scaled by 4
+  int rto;               // retransmission timeout
+  int rtt_timing;        // a segment is being timed
+  uint32 rtt_seq;        // end_seq of the timed segment
+  uint32 rtt_start;      // ticks when the timed segment was sent
+  int retries;           // consecutive retransmission timeouts
+
+  struct timer *retransmit; // retransmission timer
+
+  struct tcp_cong_ops *ca_ops; // congestion control algorithm
+  int dupacks;           // consecutive duplicate ACKs
+  int in_recovery;       // in fast recovery
+  int in_loss;           // resending from SND.UNA after a retransmission timeout
+  uint32 recover;        // snd_nxt when fast recovery or loss recovery was entered
+  uint32 high_sacked;    // highest sequence number SACKed by the peer
+  uint32 rtx_next;       // SACK recovery resends holes from here on
+  uint32 last_ofo_seq;   // most recent out-of-order segment received
+  struct timer *timewait;   // TIME-WAIT timer
+
+  // RFC 1122 delayed ACK
+  uint32 rcv_unacked;    // in-order bytes received since our last ACK
+  uint32 rcv_mss;        // largest segment received
+  struct timer *delack;  // delayed ACK timer
+
+  int refcnt;            // the owner, armed timers and tcp_sock_lookup() callers
+  int dead;              // tcp_done() has run
 
   struct spinlock spinlk;
 };
@@ -124,30 +248,66 @@ void tcpsock_dbg(char *msg, struct tcp_sock *ts);
 
 
 // tcp.c
+extern struct kmem_cache *tcp_sock_cache;
+void tcp_hash_established(struct tcp_sock *ts);
+void tcp_hash_listen(struct tcp_sock *ts);
+void tcp_unhash(struct tcp_sock *ts);
 void tcp_dump(struct tcp_hdr *tcphdr, struct mbuf *m);
 void tcp_set_state(struct tcp_sock *ts, enum tcp_states state);
 void tcp_free(struct tcp_sock *ts);
-void tcp_sock_free(struct tcp_sock *ts);
+void tcp_sock_hold(struct tcp_sock *ts);
+void tcp_sock_put(struct tcp_sock *ts);
+struct tcp_sock *tcp_sock_lock(struct tcp_sock *ts);
+void tcp_sock_unlock(struct tcp_sock *ts, struct tcp_sock *parent);
 void tcp_done(struct tcp_sock *ts);
+struct timer *tcp_timer_add(struct tcp_sock *ts, uint32 expire, void *(*handler)(void *));
+void tcp_timer_cancel(struct tcp_sock *ts, struct timer *t);
 
 // tcp_in.c
-int tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct mbuf *m);
-int tcp_receive(struct tcp_sock *ts, uint64 buf, int len);
+int tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct mbuf *m, struct tcp_options *opts);
+int tcp_receive(struct tcp_sock *ts, uint64 buf, int len, int nonblock);
 unsigned int alloc_new_iss(void);
 
 // tcp_out.c
+int tcp_v4_checksum(struct mbuf *m, uint32 saddr, uint32 daddr);
 int tcp_send_reset(struct tcp_sock *ts);
 void tcp_send_synack(struct tcp_sock *ts, struct tcp_hdr *th);
+void tcp_send_synack_cookie(struct tcp_sock *ts, struct tcp_hdr *rth, struct ip *iphdr, uint32 cookie);
 void tcp_send_syn(struct tcp_sock *ts);
 void tcp_send_ack(struct tcp_sock *ts);
+void tcp_ack_data(struct tcp_sock *ts, uint32 len);
 void tcp_send_fin(struct tcp_sock *ts);
-int tcp_send(struct tcp_sock *ts, uint64 ubuf, int len);
+int tcp_send(struct tcp_sock *ts, uint64 ubuf, int len, int nonblock);
+int tcp_send_mbuf(struct tcp_sock *ts, struct mbuf *m, int nonblock);
+uint32 tcp_sndbuf_space(struct tcp_sock *ts);
+void tcp_push(struct tcp_sock *ts);
+void tcp_retransmit(struct tcp_sock *ts);
+int tcp_retransmit_hole(struct tcp_sock *ts);
+int tcp_retransmit_loss(struct tcp_sock *ts);
+void tcp_reset_retransmit_timer(struct tcp_sock *ts);
+void tcp_clear_retransmit_timer(struct tcp_sock *ts);
+
+// tcp_cong.c
+extern struct tcp_cong_ops tcp_newreno;
+void tcp_cong_init(struct tcp_sock *ts);
+void tcp_cong_init_cwnd(struct tcp_sock *ts);
+void tcp_cong_ack(struct tcp_sock *ts, uint32 acked);
+void tcp_cong_dupack(struct tcp_sock *ts);
+void tcp_cong_timeout(struct tcp_sock *ts);
 
 
 // tcp_data.c
 int tcp_data_queue(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m);
 int tcp_data_dequeue(struct tcp_sock *ts, uint64 ubuf, int len);
+uint32 tcp_select_window(struct tcp_sock *ts);
+int tcp_sack_blocks(struct tcp_sock *ts, struct tcp_sack_block *blocks);
+
+// tcp_syncookie.c
+void tcp_syncookie_init(void);
+void tcp_syncookie_stir(uint32 isn);
+uint32 tcp_syncookie_make(uint32 laddr, uint32 raddr, uint16 lport, uint16 rport, uint32 isn, uint16 *mss);
+uint16 tcp_syncookie_check(uint32 laddr, uint32 raddr, uint16 lport, uint16 rport, uint32 isn, uint32 cookie);
 
 // tcp_socket.c
 struct tcp_sock *tcp_sock_alloc();
-struct tcp_sock *tcp_accept(struct file *f);
+int tcp_accept(struct file *f, struct tcp_sock **newts);
@@ -0,0 +1,185 @@
+//
+// TCP congestion control (RFC 5681) and NewReno loss recovery (RFC 6582),
+// resending only the holes when the peer SACKs (RFC 2018).
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "list.h"
+#include "mbuf.h"
+#include "net.h"
+#include "defs.h"
+#include "debug.h"
+#include "pollwait.h"
+#include "tcp.h"
+
+static _inline uint32
+tcp_flight_size(struct tcp_sock *ts)
+{
+  return ts->tcb.snd_nxt - ts->tcb.snd_una;
+}
+
+static uint32
+newreno_ssthresh(struct tcp_sock *ts)
+{
+  /* RFC 5681 (4): ssthresh = max(FlightSize / 2, 2 * SMSS) */
+  uint32 half = tcp_flight_size(ts) / 2;
+  return half > 2 * ts->mss ? half : 2 * ts->mss;
+}
+
+static void
+newreno_cong_avoid(struct tcp_sock *ts, uint32 acked)
+{
+  uint32 incr;
+
+  if (ts->tcb.cwnd < ts->tcb.ssthresh) {
+    /* slow start: cwnd += min(N, SMSS) */
+    ts->tcb.cwnd += acked < ts->mss ? acked : ts->mss;
+  } else {
+    /* congestion avoidance: cwnd += SMSS * SMSS / cwnd */
+    incr = ts->mss * ts->mss / ts->tcb.cwnd;
+    ts->tcb.cwnd += incr ? incr : 1;
+  }
+}
+
+struct tcp_cong_ops tcp_newreno = {
+  .name = "newreno",
+  .ssthresh = newreno_ssthresh,
+  .cong_avoid = newreno_cong_avoid,
+};
+
+// Sets the initial window; called again once the SYN fixes the MSS.
+void
+tcp_cong_init_cwnd(struct tcp_sock *ts)
+{
+  /* RFC 5681 (3): IW = min(4 * SMSS, max(2 * SMSS, 4380)) */
+  uint32 iw = 2 * ts->mss > 4380 ? 2 * ts->mss : 4380;
+  if (iw > 4 * ts->mss)
+    iw = 4 * ts->mss;
+
+  ts->tcb.cwnd = iw;
+}
+
+void
+tcp_cong_init(struct tcp_sock *ts)
+{
+  tcp_cong_init_cwnd(ts);
+  ts->tcb.ssthresh = TCP_INFINITE_SSTHRESH;
+  ts->dupacks = 0;
+  ts->in_recovery = 0;
+  ts->in_loss = 0;
+  ts->recover = 0;
+
+  if (!ts->ca_ops)
+    ts->ca_ops = &tcp_newreno;
+  if (ts->ca_ops->init)
+    ts->ca_ops->init(ts);
+}
+
+// Called with acked new bytes after SND.UNA advanced.
+void
+tcp_cong_ack(struct tcp_sock *ts, uint32 acked)
+{
+  uint32 flight;
+
+  ts->dupacks = 0;
+
+  if (ts->in_loss) {
+    /* after a timeout cwnd grows in slow start again */
+    ts->ca_ops->cong_avoid(ts, acked);
+    if (ts->tcb.snd_una >= ts->recover) {
+      ts->in_loss = 0;
+      tcpsock_dbg("loss recovery done", ts);
+      return;
+    }
+    /* partial acknowledgment: keep resending the lost window */
+    tcp_retransmit_loss(ts);
+    return;
+  }
+
+  if (!ts->in_recovery) {
+    ts->ca_ops->cong_avoid(ts, acked);
+    return;
+  }
+
+  if (ts->tcb.snd_una >= ts->recover) {
+    /* full acknowledgment: deflate the window and leave recovery */
+    flight = tcp_flight_size(ts);
+    if (flight < ts->mss)
+      flight = ts->mss;
+    ts->tcb.cwnd = ts->tcb.ssthresh < flight + ts->mss ?
+                   ts->tcb.ssthresh : flight + ts->mss;
+    ts->in_recovery = 0;
+    tcpsock_dbg("fast recovery done", ts);
+    return;
+  }
+
+  /*
+   * Partial acknowledgment: the next hole is at SND.UNA, retransmit
+   * it right away, and deflate cwnd by the amount of new data acked.
+   * With SACK, resend the next hole the peer is known to miss.
+   */
+  if (ts->sack_ok)
+    tcp_retransmit_hole(ts);
+  else
+    tcp_retransmit(ts);
+  if (ts->tcb.cwnd > acked)
+    ts->tcb.cwnd -= acked;
+  else
+    ts->tcb.cwnd = 0;
+  if (acked >= ts->mss)
+    ts->tcb.cwnd += ts->mss;
+}
+
+void
+tcp_cong_dupack(struct tcp_sock *ts)
+{
+  if (ts->in_recovery) {
+    /* each duplicate ACK means a segment has left the network */
+    ts->tcb.cwnd += ts->mss;
+    if (ts->sack_ok)
+      tcp_retransmit_hole(ts);
+    return;
+  }
+
+  if (++ts->dupacks != TCP_DUPACK_THRESH)
+    return;
+
+  /* RFC 6582: do not start recovery twice for the same window */
+  if (ts->tcb.snd_una <= ts->recover)
+    return;
+
+  /* fast retransmit */
+  ts->tcb.ssthresh = ts->ca_ops->ssthresh(ts);
+  ts->recover = ts->tcb.snd_nxt;
+  ts->in_recovery = 1;
+  ts->rtx_next = ts->tcb.snd_una;
+  tcpsock_dbg("fast retransmit", ts);
+  tcp_retransmit(ts);
+  ts->tcb.cwnd = ts->tcb.ssthresh + TCP_DUPACK_THRESH * ts->mss;
+}
+
+void
+tcp_cong_timeout(struct tcp_sock *ts)
+{
+  struct mbuf *m;
+
+  /* RFC 2018 8: the peer may have discarded SACKed data */
+  list_for_each_entry(m, &ts->write_queue.head, list)
+    m->sacked = 0;
+  ts->high_sacked = ts->tcb.snd_una;
+  ts->rtx_next = ts->tcb.snd_una;
+
+  /* RFC 5681 (4), RFC 6582 (6) */
+  ts->tcb.ssthresh = ts->ca_ops->ssthresh(ts);
+  ts->tcb.cwnd = ts->mss;
+  ts->recover = ts->tcb.snd_nxt;
+  ts->in_recovery = 0;
+  ts->in_loss = 1;
+  ts->dupacks = 0;
+}
@@ -10,17 +10,78 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "pollwait.h"
 #include "tcp.h"
+#include "uio.h"
+
+#define TCP_RCV_IOV 16  // mbufs copied out at once by a read
+
+/* Free space in the receive buffer. */
+static uint32
+tcp_rcv_space(struct tcp_sock *ts)
+{
+  return ts->rcv_queued < ts->rcvbuf ? ts->rcvbuf - ts->rcv_queued : 0;
+}
+
+/*
+ * Moves rcv_nxt over len in-order bytes. rcv_wnd counts from
+ * rcv_nxt, so it shrinks by as much: the right edge of the window
+ * we advertised stays where it was.
+ */
+static void
+tcp_rcv_advance(struct tcp_sock *ts, uint32 len)
+{
+  ts->tcb.rcv_nxt += len;
+  ts->tcb.rcv_wnd -= len < ts->tcb.rcv_wnd ? len : ts->tcb.rcv_wnd;
+}
+
+/*
+ * The smallest step the window opens by, so that it does not
+ * creep open a few bytes at a time (RFC 1122 4.2.3.3).
+ */
+static uint32
+tcp_rcv_wnd_step(struct tcp_sock *ts)
+{
+  return ts->rcv_mss < ts->rcvbuf / 2 ? ts->rcv_mss : ts->rcvbuf / 2;
+}
+
+/*
+ * Picks the window for an outgoing segment from the free receive
+ * buffer space, and returns it shifted by rcv_wscale. The window
+ * opens by at least tcp_rcv_wnd_step() and never shrinks: its right
+ * edge does not move left (RFC 793 3.7).
+ */
+uint32
+tcp_select_window(struct tcp_sock *ts)
+{
+  uint32 space = tcp_rcv_space(ts);
+
+  /* drop the bits the shift would lose, the peer cannot see them */
+  space &= ~((1U << ts->rcv_wscale) - 1);
+  if (space >= ts->tcb.rcv_wnd + tcp_rcv_wnd_step(ts))
+    ts->tcb.rcv_wnd = space;
+  return ts->tcb.rcv_wnd >> ts->rcv_wscale;
+}
 
 static void
 tcp_consume_ofo_queue(struct tcp_sock *ts)
 {
   struct mbuf *m = NULL;
   while ((m = mbuf_queue_peek(&ts->ofo_queue)) != NULL
-    && ts->tcb.rcv_nxt == m->seq) {
-      /* m is in-order, put it in receive queue */
-      ts->tcb.rcv_nxt += m->len;
+    && m->seq <= ts->tcb.rcv_nxt) {
       mbuf_dequeue(&ts->ofo_queue);
+      ts->rcv_queued -= m->len;
+      if (m->end_seq <= ts->tcb.rcv_nxt) {
+        /* covered by data already received */
+        mbuffree(m);
+        continue;
+      }
+      /* m is in-order now, trim the overlap and put it in receive queue */
+      m->head += ts->tcb.rcv_nxt - m->seq;
+      m->len -= ts->tcb.rcv_nxt - m->seq;
+      m->seq = ts->tcb.rcv_nxt;
+      tcp_rcv_advance(ts, m->len);
+      ts->rcv_queued += m->len;
       mbuf_enqueue(&ts->rcv_queue, m);
     }
 }
@@ -29,24 +90,100 @@ tcp_consume_ofo_queue(struct tcp_sock *ts)
 static void
 tcp_data_insert_ordered(struct tcp_sock *ts, struct mbuf *m)
 {
-  struct mbuf *n, *nn;
+  struct mbuf *n;
 
-  list_for_each_entry_safe(n, nn, &ts->ofo_queue.head, list) {
+  list_for_each_entry(n, &ts->ofo_queue.head, list) {
     if (m->seq < n->seq) {
       if (m->end_seq > n->seq) {
         m->len = m->len - (m->end_seq - n->seq);
+        m->end_seq = n->seq;
       }
-      m->refcnt++;
-      mbuf_enqueue(&ts->ofo_queue, m);
+      mbufhold(m);
+      mbuf_queue_add(&ts->ofo_queue, m, n);
+      ts->rcv_queued += m->len;
+      ts->last_ofo_seq = m->seq;
+      return;
+    }
+    if (m->end_seq <= n->end_seq) {
+      /* We already have this segment! */
       return;
-    } else {
-        /* We already have this segment! */
-        return;
     }
   }
 
-  m->refcnt++;
+  mbufhold(m);
   mbuf_enqueue(&ts->ofo_queue, m);
+  ts->rcv_queued += m->len;
+  ts->last_ofo_seq = m->seq;
+}
+
+static void
+tcp_sack_note(struct tcp_sock *ts, struct tcp_sack_block *b,
+              struct tcp_sack_block *blocks, int *n, int *found)
+{
+  if (!*found && b->start <= ts->last_ofo_seq && ts->last_ofo_seq < b->end) {
+    blocks[0] = *b;
+    *found = 1;
+  } else if (*n < TCP_MAX_SACKS) {
+    blocks[(*n)++] = *b;
+  }
+}
+
+/*
+ * Describes the out-of-order queue in at most TCP_MAX_SACKS blocks.
+ * RFC 2018 4: the first block holds the most recently received
+ * segment. Returns the number of blocks.
+ */
+int
+tcp_sack_blocks(struct tcp_sock *ts, struct tcp_sack_block *blocks)
+{
+  struct tcp_sack_block cur;
+  struct mbuf *m;
+  int n = 1, found = 0, started = 0;
+
+  /* blocks[0] is kept for the most recent segment */
+  list_for_each_entry(m, &ts->ofo_queue.head, list) {
+    if (started && m->seq <= cur.end) {
+      if (m->end_seq > cur.end)
+        cur.end = m->end_seq;
+      continue;
+    }
+    if (started)
+      tcp_sack_note(ts, &cur, blocks, &n, &found);
+    cur.start = m->seq;
+    cur.end = m->end_seq;
+    started = 1;
+  }
+  if (started)
+    tcp_sack_note(ts, &cur, blocks, &n, &found);
+
+  if (!found) {
+    memmove(blocks, blocks + 1, (n - 1) * sizeof(*blocks));
+    n--;
+  }
+  return n;
+}
+
+/*
+ * Appends an in-order segment to the last mbuf of the receive
+ * queue if it fits in its tailroom, so that a stream of small
+ * segments does not hold a whole buffer each and a read copies
+ * from fewer mbufs. Returns 1 if m was merged and is not needed.
+ */
+static int
+tcp_rcv_coalesce(struct tcp_sock *ts, struct mbuf *m)
+{
+  struct mbuf *t = mbuf_queue_peek_tail(&ts->rcv_queue);
+
+  if (!t || t->frag || m->frag)
+    return 0;
+  if (t->head + t->len + m->len > t->buf + t->size)
+    return 0;
+
+  memmove(t->head + t->len, m->head, m->len);
+  t->len += m->len;
+  t->end_seq = m->end_seq;
+  t->psh |= m->psh;
+  return 1;
 }
 
 int
@@ -59,15 +196,25 @@ tcp_data_queue(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m)
     return -1;
   }
 
+  m->psh = th->psh;
   if (m->seq == ts->tcb.rcv_nxt) {
-    ts->tcb.rcv_nxt += m->len;
-    m->refcnt++;
-    mbuf_enqueue(&ts->rcv_queue, m);
-
-    tcp_consume_ofo_queue(ts);
+    tcp_rcv_advance(ts, m->len);
+    ts->rcv_queued += m->len;
+    if (!tcp_rcv_coalesce(ts, m)) {
+      mbufhold(m);
+      mbuf_enqueue(&ts->rcv_queue, m);
+    }
 
     // wakeup  wait for recv
     wakeup(&ts->wait_rcv);
+    pollwake(&ts->ph);
+
+    if (mbuf_queue_empty(&ts->ofo_queue)) {
+      tcp_ack_data(ts, m->len);
+      return 0;
+    }
+    /* RFC 5681: ACK at once a segment that fills in a gap */
+    tcp_consume_ofo_queue(ts);
 
   } else {
     /* Segment passed validation, hence it is in-window
@@ -85,36 +232,56 @@ tcp_data_queue(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m)
   return 0;
 }
 
+/*
+ * Copies up to len bytes of the receive queue to ubuf. The data of
+ * up to TCP_RCV_IOV mbufs goes out in one copyoutv(), which looks
+ * up each page of ubuf once. If the read opens the window enough,
+ * a window update goes out at once. Returns the number of bytes
+ * copied, or -1 if ubuf is bad.
+ */
 int
 tcp_data_dequeue(struct tcp_sock *ts, uint64 ubuf, int len)
 {
-  struct tcp_hdr *th;
-  int rlen = 0;
-
-  while (!mbuf_queue_empty(&ts->rcv_queue) && rlen < len) {
-    struct mbuf *m = mbuf_queue_peek(&ts->rcv_queue);
-    if (m == NULL) break;
-    
-    th = (struct tcp_hdr *)(m->head - sizeof(*th));
+  struct iovec iov[TCP_RCV_IOV];
+  struct mbuf *m;
+  int i, n = 0, rlen = 0, dlen;
 
+  list_for_each_entry(m, &ts->rcv_queue.head, list) {
+    if (rlen >= len || n == TCP_RCV_IOV)
+      break;
     /* Guard datalen to not overflow userbuf */
-    int dlen = (rlen + m->len) > len ? (len - rlen) : m->len;
-    copyout(myproc()->pagetable, ubuf, m->head, dlen);
-    // memmove(ubuf, m->head, dlen);
+    dlen = (rlen + m->len) > len ? (len - rlen) : m->len;
+    iov[n].iov_base = m->head;
+    iov[n].iov_len = dlen;
+    n++;
+    rlen += dlen;
+  }
+
+  if (copyoutv(myproc()->pagetable, ubuf, iov, n) < 0)
+    return -1;
 
+  for (i = 0; i < n; i++) {
+    m = mbuf_queue_peek(&ts->rcv_queue);
     /* Accommodate next round of data dequeue */
-    m->len -= dlen;
-    m->head += dlen;
-    rlen += dlen;
-    ubuf += dlen;
+    m->len -= iov[i].iov_len;
+    m->head += iov[i].iov_len;
 
     /* mbuf is fully eaten, process flags and drop it */
     if (m->len == 0) {
-      if (th->psh) ts->flags |= TCP_PSH;
+      if (m->psh) ts->flags |= TCP_PSH;
       mbuf_dequeue(&ts->rcv_queue);
       mbuffree(m);
     }
   }
+  ts->rcv_queued -= rlen;
+
+  /* the peer may be waiting on a closed window; don't wait for
+     our next segment to tell it the window opened */
+  if ((ts->state == TCP_ESTABLISHED || ts->state == TCP_FIN_WAIT_1 ||
+       ts->state == TCP_FIN_WAIT_2) &&
+      tcp_rcv_space(ts) >= 2 * ts->tcb.rcv_wnd &&
+      tcp_rcv_space(ts) >= ts->tcb.rcv_wnd + tcp_rcv_wnd_step(ts))
+    tcp_send_ack(ts);
 
   return rlen;
 }
\ No newline at end of file
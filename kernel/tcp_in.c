@@ -10,6 +10,8 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "errno.h"
+#include "pollwait.h"
 #include "tcp.h"
 
 static int
@@ -30,6 +32,8 @@ static struct tcp_sock *
 tcp_listen_create_child_sock(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr)
 {
   struct tcp_sock *newts = tcp_sock_alloc();
+  if (!newts)
+    return NULL;
   tcp_set_state(newts, TCP_SYN_RECEIVED);
   newts->saddr = ntohl(iphdr->ip_dst);
   newts->daddr = ntohl(iphdr->ip_src);
@@ -37,8 +41,11 @@ tcp_listen_create_child_sock(struct tcp_sock *ts, struct tcp_hdr *th, struct ip
   newts->dport = th->sport;
 
   newts->parent = ts;
+  tcp_sock_hold(ts);
 
   list_add(&newts->list, &ts->listen_queue);
+  ts->syn_backlog++;
+  tcp_hash_established(newts);
 
   return newts;
 }
@@ -57,10 +64,192 @@ alloc_new_iss(void)
 }
 
 
+/* RTO = SRTT + max(G, 4 * RTTVAR), clock granularity G is one tick */
+static void
+tcp_set_rto(struct tcp_sock *ts)
+{
+  ts->rto = (ts->srtt >> 3) + (ts->rttvar > 1 ? ts->rttvar : 1);
+  if (ts->rto < TCP_RTO_MIN)
+    ts->rto = TCP_RTO_MIN;
+  else if (ts->rto > TCP_RTO_MAX)
+    ts->rto = TCP_RTO_MAX;
+}
+
+/* RFC 6298: fold a round-trip time sample r into SRTT, RTTVAR and RTO */
+static void
+tcp_rtt_estimator(struct tcp_sock *ts, int r)
+{
+  int delta;
+
+  if (!ts->srtt && !ts->rttvar) {
+    /* first measurement */
+    ts->srtt = r << 3;
+    ts->rttvar = r << 1;
+  } else {
+    delta = r - (ts->srtt >> 3);
+    ts->srtt += delta;                        /* SRTT += (R - SRTT) / 8 */
+    if (delta < 0)
+      delta = -delta;
+    ts->rttvar += delta - (ts->rttvar >> 2);  /* RTTVAR += (|R - SRTT| - RTTVAR) / 4 */
+  }
+
+  tcp_set_rto(ts);
+}
+
+/*
+ * Remove segments on the retransmission queue which are
+ * entirely acknowledged by SND.UNA, and restart the timer.
+ */
+static void
+tcp_clean_rtx_queue(struct tcp_sock *ts)
+{
+  struct mbuf *m;
+
+  while ((m = mbuf_queue_peek(&ts->write_queue)) != NULL
+    && m->end_seq <= ts->tcb.snd_una) {
+    mbuf_dequeue(&ts->write_queue);
+    mbuffree(m);
+  }
+
+  if (ts->rtt_timing && ts->rtt_seq <= ts->tcb.snd_una) {
+    ts->rtt_timing = 0;
+    tcp_rtt_estimator(ts, ticks - ts->rtt_start);
+  } else if (ts->retries) {
+    /* new data got through after a timeout: drop the backoff,
+       or every later loss in the window doubles the RTO again */
+    if (ts->srtt)
+      tcp_set_rto(ts);
+    else
+      ts->rto = TCP_RTO_INIT;
+  }
+  ts->retries = 0;
+
+  /* RFC 6298 5.2, 5.3 */
+  if (mbuf_queue_empty(&ts->write_queue))
+    tcp_clear_retransmit_timer(ts);
+  else
+    tcp_reset_retransmit_timer(ts);
+
+  wakeup(&ts->wait_snd);
+  pollwake(&ts->ph);
+}
+
+/*
+ * Applies the options on a received SYN.
+ * RFC 1122: assume an MSS of 536 when there is none, and never send
+ * more than we could receive ourselves.
+ * RFC 7323, RFC 2018: window scaling and SACK are only used when
+ * both SYNs carry the option.
+ */
+static void
+tcp_syn_options(struct tcp_sock *ts, struct tcp_options *opts)
+{
+  uint16 mss = opts->mss ? opts->mss : TCP_DEFALUT_MSS;
+
+  ts->mss = mss < TCP_MSS ? mss : TCP_MSS;
+
+  ts->wscale_ok = opts->wscale_ok;
+  if (ts->wscale_ok) {
+    ts->snd_wscale = opts->wscale;
+  } else {
+    ts->snd_wscale = 0;
+    ts->rcv_wscale = 0;
+  }
+  ts->sack_ok = opts->sack_ok;
+
+  /* the initial window is a multiple of the MSS */
+  tcp_cong_init_cwnd(ts);
+}
+
+/*
+ * RFC 2018: mark the segments on the retransmission queue that
+ * the peer reports holding, so recovery only resends the holes.
+ */
+static void
+tcp_sacktag(struct tcp_sock *ts, struct tcp_options *opts)
+{
+  struct tcp_sack_block *b;
+  struct mbuf *m;
+  int i;
+
+  for (i = 0; i < opts->nr_sacks; i++) {
+    b = &opts->sacks[i];
+    /* ignore D-SACKs and blocks outside what we have sent */
+    if (b->start >= b->end || b->start < ts->tcb.snd_una ||
+        b->end > ts->tcb.snd_nxt)
+      continue;
+
+    list_for_each_entry(m, &ts->write_queue.head, list) {
+      if (m->seq >= b->end)
+        break;
+      if (m->seq >= b->start && m->end_seq <= b->end)
+        m->sacked = 1;
+    }
+    if (b->end > ts->high_sacked)
+      ts->high_sacked = b->end;
+  }
+}
+
+/*
+ * An ACK to a listener may complete a handshake whose SYN was
+ * answered with a SYN cookie. If so, rebuild the connection and
+ * queue it for accept() directly.
+ */
+static int
+tcp_listen_cookie_ack(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr)
+{
+  uint32 laddr = ntohl(iphdr->ip_dst);
+  uint32 raddr = ntohl(iphdr->ip_src);
+  struct tcp_options opts;
+  struct tcp_sock *newts;
+
+  if (!ts->synq_overflow || ticks - ts->synq_overflow > TCP_SYNCOOKIE_VALID)
+    return -1;
+  if (ts->accept_backlog >= ts->backlog)
+    return -1;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.mss = tcp_syncookie_check(laddr, raddr, th->dport, th->sport,
+                                 th->seq - 1, th->ack_seq - 1);
+  if (!opts.mss)
+    return -1;
+
+  if ((newts = tcp_sock_alloc()) == NULL)
+    return -1;
+  newts->saddr = laddr;
+  newts->daddr = raddr;
+  newts->sport = th->dport;
+  newts->dport = th->sport;
+  newts->parent = ts;
+  tcp_sock_hold(ts);
+
+  newts->tcb.irs = th->seq - 1;
+  newts->tcb.rcv_nxt = th->seq;
+  newts->tcb.iss = th->ack_seq - 1;
+  newts->tcb.snd_una = th->ack_seq;
+  newts->tcb.snd_nxt = th->ack_seq;
+  tcp_syn_options(newts, &opts);
+  newts->tcb.snd_wnd = th->window;
+  newts->tcb.snd_wl1 = th->seq;
+  newts->tcb.snd_wl2 = th->ack_seq;
+  tcp_set_state(newts, TCP_ESTABLISHED);
+
+  list_add(&newts->list, &ts->accept_queue);
+  ts->accept_backlog++;
+  tcp_hash_established(newts);
+  tcpdbg("SYN cookie handshake successes!\n");
+  wakeup(&ts->wait_accept);
+  pollwake(&ts->ph);
+
+  return 0;
+}
+
 static int
-tcp_in_listen(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct mbuf *m)
+tcp_in_listen(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct mbuf *m, struct tcp_options *opts)
 {
   struct tcp_sock *newts;
+  uint32 cookie;
+  uint16 mss;
   tcpdbg("LISTEN\n");
   // tcpdbg("1. check rst\n");
   /* first check for an RST */
@@ -70,6 +259,8 @@ tcp_in_listen(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct
   /* sencod check for an AKC */
   // tcpdbg("2. check ack\n");
   if (th->ack) {
+    if (!th->syn && tcp_listen_cookie_ack(ts, th, iphdr) == 0)
+      goto discard;
     tcp_send_reset(ts);
     goto discard;
   }
@@ -79,6 +270,21 @@ tcp_in_listen(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct
 	/* RFC 2873: ignore the security/compartment check */
   if (!th->syn)
     goto discard;
+  tcp_syncookie_stir(th->seq);
+
+  /* no room to accept the connection, the peer will retry the SYN */
+  if (ts->accept_backlog >= ts->backlog)
+    goto discard;
+
+  /* the SYN queue is full, answer with a SYN cookie instead */
+  if (ts->syn_backlog >= ts->backlog) {
+    mss = opts->mss ? opts->mss : TCP_DEFALUT_MSS;
+    cookie = tcp_syncookie_make(ntohl(iphdr->ip_dst), ntohl(iphdr->ip_src),
+                                th->dport, th->sport, th->seq, &mss);
+    ts->synq_overflow = ticks;
+    tcp_send_synack_cookie(ts, th, iphdr, cookie);
+    goto discard;
+  }
   
   // tcpdbg("4. create child sock\n");
   /* set for first syn */
@@ -92,6 +298,7 @@ tcp_in_listen(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct
   newts->tcb.iss = alloc_new_iss();
   // tcpdbg("iss: %d\n", newts->tcb.iss);
   newts->tcb.rcv_nxt = th->seq + 1;
+  tcp_syn_options(newts, opts);
   tcp_send_synack(newts, th);
   newts->tcb.snd_nxt = newts->tcb.iss + 1;
   newts->tcb.snd_una = newts->tcb.iss;
@@ -109,7 +316,7 @@ return 0;
  * SND.UNA = ISS, SND.NXT = ISS+1
  */
 static int
-tcp_synsent(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m)
+tcp_synsent(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m, struct tcp_options *opts)
 {
   tcpdbg("SYN-SENT\n");
   /* first check the ACK bit */
@@ -138,7 +345,9 @@ tcp_synsent(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m)
       /* connect closed port */
 			tcpdbg("Error:connection reset\n");
       tcp_set_state(ts, TCP_CLOSE);
-      wakeup(&ts->wait_connect); 
+      ts->err = ECONNREFUSED;
+      wakeup(&ts->wait_connect);
+      pollwake(&ts->ph);
       // return 1;
       goto discard;
     }
@@ -152,10 +361,12 @@ tcp_synsent(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m)
   if (th->syn) {
     ts->tcb.irs = th->seq;
     ts->tcb.rcv_nxt = th->seq + 1;
+    tcp_syn_options(ts, opts);
     if (th->ack)                      /* No ack for simultaneous open */
       ts->tcb.snd_una = th->ack_seq;  /* snd_una: iss -> iss+1 */
     /* delete retransmission queue which waits to be acknowledged */
     if (ts->tcb.snd_una > ts->tcb.iss) { /* rcv.ack = snd.syn.seq+1 */
+      tcp_clean_rtx_queue(ts);
       tcp_set_state(ts, TCP_ESTABLISHED);
       /* RFC 1122: error corrections of RFC 793 */
       ts->tcb.snd_wnd = th->window;
@@ -165,6 +376,7 @@ tcp_synsent(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m)
       tcp_send_ack(ts);
       tcpdbg("Active three-way handshake successes!(SND.WIN:%d)\n", ts->tcb.snd_wnd);
       wakeup(&ts->wait_connect);
+      pollwake(&ts->ph);
 
     } else {   /* simultaneous open */
       tcp_set_state(ts, TCP_SYN_RECEIVED);
@@ -206,10 +418,12 @@ tcp_synrecv_ack(struct tcp_sock *ts)
     return -1;
   /* move it from listen queue to accept queue */
   list_del(&ts->list);
+  ts->parent->syn_backlog--;
   list_add(&ts->list, &ts->parent->accept_queue);
   ts->parent->accept_backlog++;
   tcpdbg("Passive three-way handshake successes!\n");
   wakeup(&ts->parent->wait_accept);
+  pollwake(&ts->parent->ph);
 
   return 0;
 }
@@ -218,7 +432,7 @@ static _inline void
 __tcp_update_window(struct tcp_sock *ts, struct tcp_hdr *th)
 {
   /* SND.WND is an offset from SND.UNA */
-  ts->tcb.snd_wnd = th->window;
+  ts->tcb.snd_wnd = th->window << ts->snd_wscale;
   ts->tcb.snd_wl1 = th->seq;
   ts->tcb.snd_wl2 = th->ack_seq;
 }
@@ -236,6 +450,7 @@ static void
 direct_del_child_tcpsock(struct tcp_sock *ts)
 {
   list_del(&ts->list);
+  ts->parent->syn_backlog--;
   tcp_done(ts);
 }
 
@@ -244,15 +459,31 @@ tcp_timewait_timer(void *arg)
 {
   struct tcp_sock *ts = (struct tcp_sock *)arg;
   tcp_done(ts);
+  tcp_sock_put(ts);
   return NULL;
 }
 
+/* our FIN has been sent, and everything up to it acknowledged */
+static _inline int
+tcp_fin_acked(struct tcp_sock *ts)
+{
+  return !ts->snd_fin && mbuf_queue_empty(&ts->write_queue);
+}
+
+static void
+tcp_enter_timewait(struct tcp_sock *ts)
+{
+  tcp_set_state(ts, TCP_TIME_WAIT);
+  tcp_clear_retransmit_timer(ts);
+  ts->timewait = tcp_timer_add(ts, TCP_TIMEWAIT_TIMEOUT, tcp_timewait_timer);
+}
+
 /*
  * Follows RFC793 "Segment Arrives" section closely
  */ 
 // return 1: tcp done
 int
-tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct mbuf *m)
+tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struct mbuf *m, struct tcp_options *opts)
 {
   // struct tcb *tcb = &sk->tcb;
 
@@ -263,9 +494,9 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
   case TCP_CLOSE:
     return tcp_closed(ts, th, m);
   case TCP_LISTEN:
-    return tcp_in_listen(ts, th, iphdr, m);
+    return tcp_in_listen(ts, th, iphdr, m, opts);
   case TCP_SYN_SENT:
-    return tcp_synsent(ts, th, m);
+    return tcp_synsent(ts, th, m, opts);
   }
 
   /* first check sequence number */
@@ -295,7 +526,9 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
           * when both users open simultaneously.
           */
           tcp_set_state(ts, TCP_CLOSE);
+          ts->err = ECONNREFUSED;
           wakeup(&ts->wait_connect);
+          pollwake(&ts->ph);
         }
         break;
 
@@ -313,6 +546,10 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
         break;
     }
     tcp_set_state(ts, TCP_CLOSE);
+    ts->err = ECONNRESET;
+    wakeup(&ts->wait_rcv);
+    wakeup(&ts->wait_snd);
+    pollwake(&ts->ph);
     goto drop;
   }
 
@@ -352,6 +589,7 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
           goto drop;
         }
         ts->tcb.snd_una = th->ack_seq;
+        tcp_clean_rtx_queue(ts);
         /* RFC 1122: error corrections of RFC 793(SND.W**) */
         __tcp_update_window(ts, th);
         tcp_set_state(ts, TCP_ESTABLISHED);
@@ -367,18 +605,24 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
     case TCP_CLOSING:
       tcpdbg("SND.UNA %d < SEG.ACK %d <= SND.NXT %d\n",
 				ts->tcb.snd_una, th->ack_seq, ts->tcb.snd_nxt);
+      if (ts->sack_ok && opts->nr_sacks)
+        tcp_sacktag(ts, opts);
       if (ts->tcb.snd_una < th->ack_seq && th->ack_seq <= ts->tcb.snd_nxt) {
+        uint32 acked = th->ack_seq - ts->tcb.snd_una;
         ts->tcb.snd_una = th->ack_seq;
         /*
         * remove any segments on the restransmission
         * queue which are thereby entirely acknowledged
         */
-        if (ts->state == TCP_FIN_WAIT_1) {
+        tcp_clean_rtx_queue(ts);
+        tcp_cong_ack(ts, acked);
+        if (!tcp_fin_acked(ts)) {
+          /* our FIN, if any, is not yet acknowledged */
+        } else if (ts->state == TCP_FIN_WAIT_1) {
           tcp_set_state(ts, TCP_FIN_WAIT_2);
         } else if (ts->state == TCP_CLOSING) {
           // close simultaneously
-          tcp_set_state(ts, TCP_TIME_WAIT);
-          timer_add(TCP_TIMEWAIT_TIMEOUT, tcp_timewait_timer, ts);
+          tcp_enter_timewait(ts);
           goto drop;
         } else if (ts->state == TCP_LAST_ACK) {
             tcpdbg("in last ack...\n");
@@ -401,9 +645,20 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
         * Close simultaneously in FIN_WAIT1 also causes this.
         *
         * Also window update packet will cause this situation.
+        *
+        * RFC 5681: it only counts towards fast retransmit when data
+        * is outstanding, and the segment carries no data, no SYN/FIN
+        * and does not change the window.
         */
+        if (th->ack_seq == ts->tcb.snd_una &&
+            ts->tcb.snd_nxt != ts->tcb.snd_una &&
+            m->len == 0 && !th->syn && !th->fin &&
+            (th->window << ts->snd_wscale) == ts->tcb.snd_wnd)
+          tcp_cong_dupack(ts);
       }
       tcp_update_window(ts, th);
+      /* the window may have opened, send more of the send buffer */
+      tcp_push(ts);
       break;
     case TCP_FIN_WAIT_2:
       /*
@@ -459,6 +714,7 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
     // TODO: recv notify
     tcp_send_ack(ts);
     wakeup(&ts->wait_rcv);
+    pollwake(&ts->ph);
 
     switch (ts->state) {
       case TCP_SYN_RECEIVED:
@@ -469,10 +725,8 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
          /* If our FIN has been ACKed (perhaps in this segment), then
                enter TIME-WAIT, start the time-wait timer, turn off the other
                timers; otherwise enter the CLOSING state. */
-        if (mbuf_queue_empty(&ts->write_queue)) {
-          //TODO: TimeWait timer
-          tcp_set_state(ts, TCP_TIME_WAIT);
-          timer_add(TCP_TIMEWAIT_TIMEOUT, tcp_timewait_timer, ts);
+        if (tcp_fin_acked(ts)) {
+          tcp_enter_timewait(ts);
         } else {
           tcp_set_state(ts, TCP_CLOSING);
         }
@@ -480,9 +734,7 @@ tcp_input_state(struct tcp_sock *ts, struct tcp_hdr *th, struct ip *iphdr, struc
       case TCP_FIN_WAIT_2:
         /* Enter the TIME-WAIT state.  Start the time-wait timer, turn
                off the other timers. */
-        //TODO: TimeWait timer
-        tcp_set_state(ts, TCP_TIME_WAIT);
-        timer_add(TCP_TIMEWAIT_TIMEOUT, tcp_timewait_timer, ts);
+        tcp_enter_timewait(ts);
         break;
       case TCP_CLOSE_WAIT:
       case TCP_CLOSE:
@@ -502,14 +754,18 @@ drop:
   return 0;
 }
 
+// Copies received data to ubuf, sleeping until len bytes, a push
+// or the end of the stream arrive. A non-blocking receive takes
+// what is there, or returns -EAGAIN if nothing is.
 int
-tcp_receive(struct tcp_sock *ts, uint64 ubuf, int len)
+tcp_receive(struct tcp_sock *ts, uint64 ubuf, int len, int nonblock)
 {
   int rlen = 0;
   int curlen = 0;
   
   while (rlen < len) {
-    curlen = tcp_data_dequeue(ts, ubuf + rlen, len - rlen);
+    if ((curlen = tcp_data_dequeue(ts, ubuf + rlen, len - rlen)) < 0)
+      return rlen ? rlen : -1;
     rlen += curlen;
 
     if (ts->flags & TCP_PSH) {
@@ -520,7 +776,13 @@ tcp_receive(struct tcp_sock *ts, uint64 ubuf, int len)
     if (ts->flags & TCP_FIN || rlen == len)
       break;
 
+    /* connection aborted */
+    if (ts->state == TCP_CLOSE)
+      break;
+
     if (rlen < len) {
+      if (nonblock)
+        return rlen ? rlen : -EAGAIN;
       sleep(&ts->wait_rcv, &ts->spinlk);
     }
     
@@ -10,7 +10,10 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "errno.h"
+#include "pollwait.h"
 #include "tcp.h"
+#include "timer.h"
 
 uint32 
 sum_every_16bits(void *addr, int count)
@@ -49,30 +52,73 @@ checksum(void *addr, int count, int start_sum)
     return ~sum;
 }
 
+static _inline uint32
+fold16(uint32 sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+// Checksums the segment in the mbuf chain m. A buffer that starts
+// at an odd offset in the segment has its bytes paired the other
+// way around, so its sum is byte-swapped (RFC 1071 2.B).
 int
 tcp_v4_checksum(struct mbuf *m, uint32 saddr, uint32 daddr)
 {
-  uint32 sum = 0;
-  
-  sum += saddr;
-  sum += daddr;
+  uint32 sum = 0, s;
+  int odd = 0;
+
+  sum += fold16(saddr);
+  sum += fold16(daddr);
   sum += htons(IPPROTO_TCP);
-  sum += htons(m->len);
+  sum += htons(mbuf_pktlen(m));
+
+  for (; m; m = m->frag) {
+    s = fold16(sum_every_16bits(m->head, m->len));
+    if (odd)
+      s = ((s & 0xff) << 8) | (s >> 8);
+    sum += s;
+    odd ^= m->len & 1;
+  }
 
-  return checksum(m->head, m->len, sum);
+  return (uint16)~fold16(sum);
+}
+
+// Checksums the segment m, whose header is th, or leaves that
+// to the device if it can.
+static void
+tcp_csum(struct mbuf *m, struct tcp_hdr *th, uint32 saddr, uint32 daddr)
+{
+  th->checksum = 0;
+  if (m->gso_size) {
+    /* summed per segment, by the device or by net_gso_segment();
+       the device adds each segment's length to the pseudo-header */
+    if (net_offload & NET_OFFLOAD_CSUM) {
+      th->checksum = in_pseudo_sum(saddr, daddr, IPPROTO_TCP, 0);
+      m->csum |= MBUF_CSUM_TCP;
+    }
+  } else if (net_offload & NET_OFFLOAD_CSUM) {
+    th->checksum = in_pseudo_sum(saddr, daddr, IPPROTO_TCP, mbuf_pktlen(m));
+    m->csum |= MBUF_CSUM_TCP;
+  } else {
+    th->checksum = tcp_v4_checksum(m, saddr, daddr);
+  }
 }
 
 // th is the pointer of tcp_hdr in mbuf.
 void 
 tcp_transmit_mbuf(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m, uint32 seq)
 {
-  th->doff = TCP_DOFFSET;
+  /* RFC 7323 2.2: the window in a SYN segment is never scaled */
+  uint32 wnd = th->syn ? ts->tcb.rcv_wnd : tcp_select_window(ts);
+
   th->sport = ts->sport;
   th->dport = ts->dport;
   th->seq = seq;
   th->ack_seq = ts->tcb.rcv_nxt;
   th->reserved = 0;
-  th->window = ts->tcb.rcv_wnd;
+  th->window = wnd > 0xffff ? 0xffff : wnd;
   th->checksum = 0;
   th->urg = 0;
 
@@ -86,20 +132,387 @@ tcp_transmit_mbuf(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m, uint3
   th->window = htons(th->window);
   th->checksum = htons(th->checksum);
   th->urg = htons(th->urg);
-  th->checksum = tcp_v4_checksum(m, htonl(ts->saddr), htonl(ts->daddr));
+  tcp_csum(m, th, htonl(ts->saddr), htonl(ts->daddr));
+
+  /* any segment with ACK set acknowledges RCV.NXT, a delayed ACK rides on it */
+  if (th->ack) {
+    ts->rcv_unacked = 0;
+    if (ts->delack) {
+      tcp_timer_cancel(ts, ts->delack);
+      ts->delack = NULL;
+    }
+  }
 
   net_tx_ip(m, IPPROTO_TCP, ts->daddr);
 }
 
+// Prepends a zeroed TCP header followed by optlen bytes of options.
+static struct tcp_hdr *
+tcp_push_hdr(struct mbuf *m, int optlen)
+{
+  struct tcp_hdr *th = (struct tcp_hdr *)mbufpush(m, TCP_HDR_LEN + optlen);
+
+  memset(th, 0, TCP_HDR_LEN);
+  th->doff = (TCP_HDR_LEN + optlen) / 4;
+  return th;
+}
+
+// Prepends the header of a SYN segment, which carries our MSS and
+// offers window scaling and SACK. A SYN-ACK only echoes the options
+// the peer's SYN offered.
+static struct tcp_hdr *
+tcp_push_syn_hdr(struct tcp_sock *ts, struct mbuf *m)
+{
+  int active = ts->state == TCP_SYN_SENT;
+  int wscale = active || ts->wscale_ok;
+  int sack = active || ts->sack_ok;
+  struct tcp_hdr *th;
+  uint8 *opt;
+
+  th = tcp_push_hdr(m, TCPOLEN_MSS + (wscale ? 4 : 0) + (sack ? 4 : 0));
+  opt = (uint8 *)(th + 1);
+
+  opt[0] = TCPOPT_MSS;
+  opt[1] = TCPOLEN_MSS;
+  opt[2] = TCP_MSS >> 8;
+  opt[3] = TCP_MSS & 0xff;
+  opt += TCPOLEN_MSS;
+
+  if (wscale) {
+    opt[0] = TCPOPT_NOP;
+    opt[1] = TCPOPT_WINDOW;
+    opt[2] = TCPOLEN_WINDOW;
+    opt[3] = ts->rcv_wscale;
+    opt += 4;
+  }
+  if (sack) {
+    opt[0] = TCPOPT_NOP;
+    opt[1] = TCPOPT_NOP;
+    opt[2] = TCPOPT_SACK_PERM;
+    opt[3] = TCPOLEN_SACK_PERM;
+  }
+  return th;
+}
+
+static void
+tcp_opt_put32(uint8 *p, uint32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// Prepends the header of an ACK, which reports the out-of-order
+// queue in SACK blocks when the peer understands them.
+static struct tcp_hdr *
+tcp_push_ack_hdr(struct tcp_sock *ts, struct mbuf *m)
+{
+  struct tcp_sack_block blocks[TCP_MAX_SACKS];
+  struct tcp_hdr *th;
+  uint8 *opt;
+  int i, n = 0;
+
+  if (ts->sack_ok)
+    n = tcp_sack_blocks(ts, blocks);
+  if (!n)
+    return tcp_push_hdr(m, 0);
+
+  th = tcp_push_hdr(m, 2 + TCPOLEN_SACK_BASE + n * TCPOLEN_SACK_PERBLOCK);
+  opt = (uint8 *)(th + 1);
+  opt[0] = TCPOPT_NOP;
+  opt[1] = TCPOPT_NOP;
+  opt[2] = TCPOPT_SACK;
+  opt[3] = TCPOLEN_SACK_BASE + n * TCPOLEN_SACK_PERBLOCK;
+  opt += 4;
+  for (i = 0; i < n; i++) {
+    tcp_opt_put32(opt, blocks[i].start);
+    tcp_opt_put32(opt + 4, blocks[i].end);
+    opt += TCPOLEN_SACK_PERBLOCK;
+  }
+  return th;
+}
+
+// Sends a segment from the write queue. The header is copied into
+// a small mbuf, and the data follows it in a chain without being
+// copied, so the driver and the write queue can both hold the data
+// while the header of another transmission is rewritten.
+static void
+tcp_transmit_queued(struct tcp_sock *ts, struct mbuf *m)
+{
+  int hlen = m->head - m->tcphdr;
+  struct mbuf *h;
+  struct tcp_hdr *th;
+
+  h = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
+  if (!h)
+    return;
+  th = (struct tcp_hdr *)mbufput(h, hlen);
+  memmove(th, m->tcphdr, hlen);
+  if (m->len) {
+    h->frag = m;
+    mbufhold(m);
+  }
+
+  tcp_transmit_mbuf(ts, th, h, m->seq);
+}
+
+// Sends n consecutive segments of the write queue, starting at m,
+// one by one.
+static void
+tcp_transmit_each(struct tcp_sock *ts, struct mbuf *m, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tcp_transmit_queued(ts, m);
+    m = list_entry(m->list.next, struct mbuf, list);
+  }
+}
+
+// Sends n consecutive segments of the write queue, starting at m,
+// as one super-segment, which the device cuts into segments again
+// with TSO, or net_tx_eth() does in software. The data is chained
+// through clones, since each queued mbuf may also be resent on
+// its own. All but the last segment are full-sized, so either way
+// the segments on the wire are those on the write queue.
+static void
+tcp_transmit_gso(struct tcp_sock *ts, struct mbuf *m, int n)
+{
+  int hlen = m->head - m->tcphdr;
+  struct mbuf *h, *c, *first = m, **tail;
+  struct tcp_hdr *th;
+  int i;
+
+  if (n == 1) {
+    tcp_transmit_queued(ts, m);
+    return;
+  }
+
+  h = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
+  if (!h) {
+    /* out of headers, send the segments one by one */
+    tcp_transmit_each(ts, first, n);
+    return;
+  }
+  th = (struct tcp_hdr *)mbufput(h, hlen);
+  memmove(th, m->tcphdr, hlen);
+  h->gso_size = ts->mss;
+
+  tail = &h->frag;
+  for (i = 0; i < n; i++) {
+    if (i > 0)
+      m = list_entry(m->list.next, struct mbuf, list);
+    if ((c = mbufclone(m)) == 0) {
+      /* out of clones, send the segments one by one */
+      mbuffree(h);
+      tcp_transmit_each(ts, first, n);
+      return;
+    }
+    *tail = c;
+    tail = &c->frag;
+  }
+
+  /* PSH and FIN are the last segment's */
+  th->psh = ((struct tcp_hdr *)m->tcphdr)->psh;
+  th->fin = ((struct tcp_hdr *)m->tcphdr)->fin;
+
+  tcp_transmit_mbuf(ts, th, h, first->seq);
+}
+
+// Puts a segment that occupies sequence space on the write queue,
+// where it stays until it is acknowledged. The queued mbuf keeps the
+// header in its headroom as a template for each transmission.
+static void
+tcp_queue_mbuf(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m, uint32 seq)
+{
+  m->seq = seq;
+  m->end_seq = seq + (m->len - th->doff * 4) + th->syn + th->fin;
+  m->tcphdr = (char *)th;
+  m->sacked = 0;
+  mbufpull(m, th->doff * 4);
+  mbufhold(m);
+  mbuf_enqueue(&ts->write_queue, m);
+
+  if (!ts->rtt_timing) {
+    ts->rtt_timing = 1;
+    ts->rtt_seq = m->end_seq;
+    ts->rtt_start = ticks;
+  }
+  if (!ts->retransmit)
+    tcp_reset_retransmit_timer(ts);
+}
+
+// Sends a segment that occupies sequence space, keeping it on the
+// write queue until it is acknowledged.
+static void
+tcp_queue_transmit_mbuf(struct tcp_sock *ts, struct tcp_hdr *th, struct mbuf *m, uint32 seq)
+{
+  tcp_queue_mbuf(ts, th, m, seq);
+  tcp_transmit_queued(ts, m);
+}
+
+// Resends the oldest unacknowledged segment.
+void
+tcp_retransmit(struct tcp_sock *ts)
+{
+  struct mbuf *m = mbuf_queue_peek(&ts->write_queue);
+  if (!m)
+    return;
+
+  tcp_transmit_queued(ts, m);
+  if (m->end_seq > ts->rtx_next)
+    ts->rtx_next = m->end_seq;
+  /* Karn's algorithm: never sample the RTT of a retransmitted segment */
+  ts->rtt_timing = 0;
+}
+
+// SACK loss recovery (RFC 2018): resends the first segment below the
+// highest SACKed sequence number that the peer does not hold and
+// that has not been resent yet. Returns 1 if a segment was sent.
+int
+tcp_retransmit_hole(struct tcp_sock *ts)
+{
+  struct mbuf *m;
+
+  list_for_each_entry(m, &ts->write_queue.head, list) {
+    if (m->seq >= ts->high_sacked)
+      break;
+    if (m->sacked || m->seq < ts->rtx_next)
+      continue;
+
+    tcp_transmit_queued(ts, m);
+    ts->rtx_next = m->end_seq;
+    ts->rtt_timing = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Loss recovery after a retransmission timeout: the segments after
+// the one the timer resent were most likely lost too, so they are
+// resent from rtx_next up to recover as cwnd opens (go-back-N),
+// skipping those the peer SACKs. Returns the number of segments sent.
+int
+tcp_retransmit_loss(struct tcp_sock *ts)
+{
+  struct mbuf *m;
+  int sent = 0;
+
+  if (ts->rtx_next < ts->tcb.snd_una)
+    ts->rtx_next = ts->tcb.snd_una;
+
+  list_for_each_entry(m, &ts->write_queue.head, list) {
+    if (m->seq >= ts->recover)
+      break;
+    if (m->sacked || m->seq < ts->rtx_next)
+      continue;
+    /* what was resent since SND.UNA is in flight again */
+    if (m->end_seq - ts->tcb.snd_una > ts->tcb.cwnd)
+      break;
+
+    tcp_transmit_queued(ts, m);
+    ts->rtx_next = m->end_seq;
+    sent++;
+  }
+  if (sent)
+    ts->rtt_timing = 0;
+  return sent;
+}
+
+static void
+tcp_retransmit_timeout(struct tcp_sock *ts)
+{
+  struct tcp_sock *parent = tcp_sock_lock(ts);
+
+  /* the timer was cleared or rearmed after this one fired */
+  if (ts->dead || !ts->retransmit || ts->retransmit->expires > ticks) {
+    tcp_sock_unlock(ts, parent);
+    return;
+  }
+  timer_release(ts->retransmit);
+  ts->retransmit = NULL;
+
+  if (mbuf_queue_empty(&ts->write_queue)) {
+    tcp_sock_unlock(ts, parent);
+    return;
+  }
+
+  if (++ts->retries > TCP_MAX_RETRIES) {
+    tcpsock_dbg("retransmission timeout, abort", ts);
+    if (ts->state == TCP_SYN_RECEIVED && ts->parent) {
+      /* embryonic connection, drop it from the listen queue,
+         which tcp_sock_lock() locked */
+      list_del(&ts->list);
+      ts->parent->syn_backlog--;
+    } else if (ts->state != TCP_FIN_WAIT_1 &&
+               ts->state != TCP_CLOSING &&
+               ts->state != TCP_LAST_ACK) {
+      /* signal user "connection aborted", close() frees the socket */
+      mbuf_queue_free(&ts->write_queue);
+      mbuf_queue_free(&ts->snd_queue);
+      ts->snd_queued = 0;
+      tcp_set_state(ts, TCP_CLOSE);
+      ts->err = ETIMEDOUT;
+      wakeup(&ts->wait_connect);
+      wakeup(&ts->wait_rcv);
+      wakeup(&ts->wait_snd);
+      pollwake(&ts->ph);
+      tcp_sock_unlock(ts, parent);
+      return;
+    }
+    /* nobody owns the socket any more */
+    tcp_sock_unlock(ts, parent);
+    tcp_done(ts);
+    return;
+  }
+
+  tcpsock_dbg("retransmit", ts);
+  tcp_cong_timeout(ts);
+  tcp_retransmit(ts);
+
+  /* RFC 6298 5.5: back off the timer */
+  ts->rto = ts->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : ts->rto * 2;
+  tcp_reset_retransmit_timer(ts);
+
+  tcp_sock_unlock(ts, parent);
+}
+
+void *
+tcp_retransmit_timer(void *arg)
+{
+  struct tcp_sock *ts = (struct tcp_sock *)arg;
+
+  tcp_retransmit_timeout(ts);
+  tcp_sock_put(ts);
+  return NULL;
+}
+
+void
+tcp_reset_retransmit_timer(struct tcp_sock *ts)
+{
+  tcp_clear_retransmit_timer(ts);
+  ts->retransmit = tcp_timer_add(ts, ts->rto, tcp_retransmit_timer);
+}
+
+void
+tcp_clear_retransmit_timer(struct tcp_sock *ts)
+{
+  if (ts->retransmit) {
+    tcp_timer_cancel(ts, ts->retransmit);
+    ts->retransmit = NULL;
+  }
+}
+
 
 int
 tcp_send_reset(struct tcp_sock *ts)
 {
-  struct mbuf *m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  struct mbuf *m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return -1;
 
-  struct tcp_hdr *th = mbufpushhdr(m, *th);
+  struct tcp_hdr *th = tcp_push_hdr(m, 0);
 
   th->rst = 1;
   ts->tcb.snd_una = ts->tcb.snd_nxt; // ?
@@ -122,18 +535,48 @@ tcp_send_synack(struct tcp_sock *ts, struct tcp_hdr *rth)
   if (rth->rst)
     return;
 
-  struct mbuf *m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  struct mbuf *m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return;
 
-  struct tcp_hdr *th = mbufpushhdr(m, *th);
+  struct tcp_hdr *th = tcp_push_syn_hdr(ts, m);
 
   th->syn = 1;
   th->ack = 1;
   
   tcpsock_dbg("send synack", ts);
 
-  tcp_transmit_mbuf(ts, th, m, ts->tcb.iss);
+  tcp_queue_transmit_mbuf(ts, th, m, ts->tcb.iss);
+}
+
+// Answers a SYN to listener ts with a SYN-ACK whose ISS is a SYN
+// cookie, keeping no state. Only the MSS option is offered, since
+// the cookie cannot carry window scaling or SACK.
+void
+tcp_send_synack_cookie(struct tcp_sock *ts, struct tcp_hdr *rth, struct ip *iphdr, uint32 cookie)
+{
+  struct mbuf *m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
+  if (!m)
+    return;
+
+  struct tcp_hdr *th = tcp_push_hdr(m, TCPOLEN_MSS);
+  uint8 *opt = (uint8 *)(th + 1);
+
+  opt[0] = TCPOPT_MSS;
+  opt[1] = TCPOLEN_MSS;
+  opt[2] = TCP_MSS >> 8;
+  opt[3] = TCP_MSS & 0xff;
+
+  th->sport = htons(rth->dport);
+  th->dport = htons(rth->sport);
+  th->seq = htonl(cookie);
+  th->ack_seq = htonl(rth->seq + 1);
+  th->syn = 1;
+  th->ack = 1;
+  th->window = htons(ts->tcb.rcv_wnd > 0xffff ? 0xffff : ts->tcb.rcv_wnd);
+  tcp_csum(m, th, iphdr->ip_dst, iphdr->ip_src);
+
+  net_tx_ip(m, IPPROTO_TCP, ntohl(iphdr->ip_src));
 }
 
 void
@@ -141,14 +584,14 @@ tcp_send_syn(struct tcp_sock *ts)
 {
   if (ts->state == TCP_CLOSE) return;
 
-  struct mbuf *m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  struct mbuf *m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return;
 
-  struct tcp_hdr *th = mbufpushhdr(m, *th);
+  struct tcp_hdr *th = tcp_push_syn_hdr(ts, m);
   th->syn = 1;
 
-  tcp_transmit_mbuf(ts, th, m, ts->tcb.iss);
+  tcp_queue_transmit_mbuf(ts, th, m, ts->tcb.iss);
 }
 
 void
@@ -156,67 +599,287 @@ tcp_send_ack(struct tcp_sock *ts)
 {
   if (ts->state == TCP_CLOSE) return;
 
-  struct mbuf *m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  struct mbuf *m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return;
 
-  struct tcp_hdr *th = mbufpushhdr(m, *th);
+  struct tcp_hdr *th = tcp_push_ack_hdr(ts, m);
 
   th->ack = 1;
 
   tcp_transmit_mbuf(ts, th, m, ts->tcb.snd_nxt);
 }
 
+static void *
+tcp_delack_timer(void *arg)
+{
+  struct tcp_sock *ts = (struct tcp_sock *)arg;
+
+  acquire(&ts->spinlk);
+  /* the ACK went out, or the timer was rearmed, after this one fired */
+  if (ts->delack && ts->delack->expires <= ticks) {
+    timer_release(ts->delack);
+    ts->delack = NULL;
+    if (ts->rcv_unacked)
+      tcp_send_ack(ts);
+  }
+  release(&ts->spinlk);
+  tcp_sock_put(ts);
+  return NULL;
+}
+
+// Acknowledges len bytes of in-order data. RFC 1122 4.2.3.2: ACK
+// at least every second full-sized segment, otherwise wait for
+// outgoing data to carry the ACK or for the delayed ACK timer.
+void
+tcp_ack_data(struct tcp_sock *ts, uint32 len)
+{
+  if (len > ts->rcv_mss)
+    ts->rcv_mss = len < TCP_MSS ? len : TCP_MSS;
+
+  ts->rcv_unacked += len;
+  if (ts->rcv_unacked >= 2 * ts->rcv_mss) {
+    tcp_send_ack(ts);
+    return;
+  }
+
+  if (!ts->delack)
+    ts->delack = tcp_timer_add(ts, TCP_DELACK_TIMEOUT, tcp_delack_timer);
+  if (!ts->delack)
+    tcp_send_ack(ts);
+}
+
 void
 tcp_send_fin(struct tcp_sock *ts)
 {
   if (ts->state == TCP_CLOSE) return;
 
-  struct mbuf *m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  /* the FIN goes out with the last segment of the send buffer */
+  ts->snd_fin = 1;
+  if (!mbuf_queue_empty(&ts->snd_queue)) {
+    tcp_push(ts);
+    return;
+  }
+
+  struct mbuf *m = mbufalloc_hdr(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return;
 
-  struct tcp_hdr *th = mbufpushhdr(m, *th);
+  struct tcp_hdr *th = tcp_push_hdr(m, 0);
 
   th->ack = 1;
   th->fin = 1;
 
-  // ToDo: Add write queue
-  tcp_transmit_mbuf(ts, th, m, ts->tcb.snd_nxt);
+  ts->snd_fin = 0;
+  tcp_queue_transmit_mbuf(ts, th, m, ts->tcb.snd_nxt);
+  ts->tcb.snd_nxt++;
 }
 
 
 
-int
-tcp_send(struct tcp_sock *ts, uint64 ubuf, int len)
+// Usable window: min(cwnd, SND.WND) minus the data in flight.
+static uint32
+tcp_send_window(struct tcp_sock *ts)
 {
-  int slen = len;
-  int dlen = 0;
+  uint32 wnd = ts->tcb.cwnd < ts->tcb.snd_wnd ? ts->tcb.cwnd : ts->tcb.snd_wnd;
+  uint32 inflight = ts->tcb.snd_nxt - ts->tcb.snd_una;
 
+  return inflight < wnd ? wnd - inflight : 0;
+}
 
-  while (slen > 0) {
-    dlen = slen > TCP_DEFALUT_MSS ? TCP_DEFALUT_MSS : slen;
-    slen -= dlen;
+// Free space in the send buffer, which holds both the data
+// not yet sent and the data in flight.
+uint32
+tcp_sndbuf_space(struct tcp_sock *ts)
+{
+  uint32 used = ts->snd_queued + (ts->tcb.snd_nxt - ts->tcb.snd_una);
 
-    //memmove(m->head, ubuf, dlen);
-    struct mbuf *m = mbufalloc(MBUF_DEFAULT_HEADROOM);
-    if (!m) return len - slen;
-    copyin(myproc()->pagetable, m->head, ubuf, dlen);
-    m->len += dlen;
-    ubuf += dlen;
-    
-    struct tcp_hdr *th = mbufpushhdr(m, *th);
+  return used < ts->sndbuf ? ts->sndbuf - used : 0;
+}
 
+// Nagle (RFC 896, RFC 1122 4.2.3.4): the partial segment at the
+// tail of the send buffer waits while earlier data is unacknowledged,
+// so that small writes coalesce. TCP_NODELAY turns this off, and
+// TCP_CORK holds it until the socket is uncorked. A pending FIN
+// flushes it either way.
+static int
+tcp_nagle_hold(struct tcp_sock *ts, struct mbuf *m)
+{
+  if (m->len >= ts->mss || ts->snd_fin)
+    return 0;
+  if (m != mbuf_queue_peek_tail(&ts->snd_queue))
+    return 0;
+  if (ts->cork)
+    return 1;
+  if (ts->nodelay)
+    return 0;
+  return ts->tcb.snd_nxt != ts->tcb.snd_una;
+}
+
+// Transmits data from the send buffer as far as cwnd and
+// the peer's receive window allow. Runs of full-sized segments
+// go down to the device as super-segments of up to 64KB.
+void
+tcp_push(struct tcp_sock *ts)
+{
+  struct mbuf *m, *n, *first = NULL, *prev = NULL;
+  struct tcp_hdr *th;
+  uint32 wnd, dlen, gso_len = 0;
+  int nsegs = 0, room = 0, join;
+
+  while ((m = mbuf_queue_peek(&ts->snd_queue)) != NULL) {
+    dlen = m->len;
+
+    if (tcp_nagle_hold(ts, m))
+      break;
+
+    if ((wnd = tcp_send_window(ts)) < dlen) {
+      if (ts->tcb.snd_nxt != ts->tcb.snd_una)
+        break;
+      /* nothing in flight: send what fits, or probe a zero window */
+      if (!wnd)
+        wnd = 1;
+      n = mbufalloc(MBUF_DEFAULT_HEADROOM);
+      if (!n)
+        break;
+      memmove(mbufput(n, dlen - wnd), m->head + wnd, dlen - wnd);
+      mbuftrim(m, dlen - wnd);
+      list_add(&n->list, &m->list);
+      ts->snd_queue.len++;
+      dlen = wnd;
+    }
+
+    /* a super-segment is no larger than the transmit ring can take */
+    join = first && prev->len == ts->mss && nsegs < net_gso_max_segs &&
+           nsegs < room && gso_len + dlen <= TCP_GSO_MAX_SIZE;
+    if (!join) {
+      if (first)
+        tcp_transmit_gso(ts, first, nsegs);
+      first = NULL;
+      /* the ring is full: the rest waits in the send buffer for
+         the ACK of what is in flight, rather than be counted as
+         sent and dropped by the device */
+      room = net_gso_room();
+      if (room <= 0 && ts->tcb.snd_nxt != ts->tcb.snd_una)
+        break;
+    }
+
+    mbuf_dequeue(&ts->snd_queue);
+    ts->snd_queued -= dlen;
+
+    th = tcp_push_hdr(m, 0);
     th->ack = 1;
-    if (slen == 0) {
+    if (mbuf_queue_empty(&ts->snd_queue)) {
       th->psh = 1;
+      th->fin = ts->snd_fin;
+      ts->snd_fin = 0;
     }
 
-    // ToDo: Add write queue
-    tcp_transmit_mbuf(ts, th, m, ts->tcb.snd_nxt);
-    ts->tcb.snd_nxt += dlen;
-    //tcpdbg("after send data, snd_nxt: %d\n", ts->tcb.snd_nxt);
+    tcp_queue_mbuf(ts, th, m, ts->tcb.snd_nxt);
+    ts->tcb.snd_nxt += dlen + th->fin;
+
+    if (join) {
+      nsegs++;
+      gso_len += dlen;
+    } else {
+      first = m;
+      nsegs = 1;
+      gso_len = dlen;
+    }
+    prev = m;
+  }
+  if (first)
+    tcp_transmit_gso(ts, first, nsegs);
+
+  /* a FIN whose mbuf could not be allocated earlier */
+  if (ts->snd_fin && mbuf_queue_empty(&ts->snd_queue))
+    tcp_send_fin(ts);
+}
+
+// Copies user data into the send buffer and starts transmitting it.
+// Sleeps while the buffer is full, unless nonblock is set; then it
+// returns what fit, or -EAGAIN if nothing did.
+int
+tcp_send(struct tcp_sock *ts, uint64 ubuf, int len, int nonblock)
+{
+  struct proc *p = myproc();
+  struct mbuf *m;
+  uint32 space;
+  int copied = 0;
+  int n;
+
+  while (copied < len) {
+    while ((space = tcp_sndbuf_space(ts)) == 0) {
+      if (nonblock)
+        return copied ? copied : -EAGAIN;
+      sleep(&ts->wait_snd, &ts->spinlk);
+      if (p->killed ||
+          (ts->state != TCP_ESTABLISHED && ts->state != TCP_CLOSE_WAIT))
+        return copied ? copied : -1;
+    }
+
+    /* fill up the last unsent segment before starting a new one */
+    m = mbuf_queue_peek_tail(&ts->snd_queue);
+    if (!m || m->len >= ts->mss) {
+      m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+      if (!m)
+        return copied ? copied : -1;
+      mbuf_enqueue(&ts->snd_queue, m);
+    }
+
+    n = len - copied;
+    if (n > ts->mss - m->len)
+      n = ts->mss - m->len;
+    if (n > space)
+      n = space;
+
+    if (copyin(p->pagetable, mbufput(m, n), ubuf + copied, n) < 0) {
+      mbuftrim(m, n);
+      if (m->len == 0) {
+        mbuf_unlink(&ts->snd_queue, m);
+        mbuffree(m);
+      }
+      return copied ? copied : -1;
+    }
+    ts->snd_queued += n;
+    copied += n;
+
+    tcp_push(ts);
+  }
+
+  return copied;
+}
+
+// Appends the data in m to the send buffer as a segment of its own
+// and starts transmitting it. Sleeps while the buffer is full, or
+// fails with -EAGAIN if nonblock. Consumes m. Returns the number of
+// bytes queued, or an error.
+int
+tcp_send_mbuf(struct tcp_sock *ts, struct mbuf *m, int nonblock)
+{
+  struct proc *p = myproc();
+  uint32 len = m->len;
+  uint32 space;
+
+  for (;;) {
+    if (p->killed ||
+        (ts->state != TCP_ESTABLISHED && ts->state != TCP_CLOSE_WAIT)) {
+      mbuffree(m);
+      return -1;
+    }
+    /* an empty buffer takes the segment even if sndbuf is smaller */
+    space = tcp_sndbuf_space(ts);
+    if (space >= len || space == ts->sndbuf)
+      break;
+    if (nonblock) {
+      mbuffree(m);
+      return -EAGAIN;
+    }
+    sleep(&ts->wait_snd, &ts->spinlk);
   }
 
+  mbuf_enqueue(&ts->snd_queue, m);
+  ts->snd_queued += len;
+  tcp_push(ts);
   return len;
 }
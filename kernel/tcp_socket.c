@@ -10,22 +10,35 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "errno.h"
+#include "pollwait.h"
 #include "tcp.h"
 #include "fs.h"
 #include "file.h"
+#include "poll.h"
 
 extern uint32 local_ip;
 
 struct tcp_sock *
 tcp_sock_alloc()
 {
-  struct tcp_sock *ts = (struct tcp_sock *)kalloc();
+  struct tcp_sock *ts = kmem_cache_alloc(tcp_sock_cache);
   if (!ts) return NULL;
   memset(ts, 0, sizeof(*ts));
 
   ts->saddr = local_ip;
   ts->state = TCP_CLOSE;
-  ts->tcb.rcv_wnd = TCP_DEFAULT_WINDOW;
+  ts->rcvbuf = TCP_DEFAULT_WINDOW;
+  ts->tcb.rcv_wnd = ts->rcvbuf;
+  /* smallest shift that lets the window fit in 16 bits */
+  while ((ts->rcvbuf >> ts->rcv_wscale) > 0xffff)
+    ts->rcv_wscale++;
+  ts->sndbuf = TCP_DEFAULT_SNDBUF;
+  ts->mss = TCP_DEFALUT_MSS;
+  ts->rcv_mss = TCP_DEFALUT_MSS;
+  ts->rto = TCP_RTO_INIT;
+  ts->refcnt = 1;
+  tcp_cong_init(ts);
 
   list_init(&ts->listen_queue);
   list_init(&ts->accept_queue);
@@ -33,13 +46,11 @@ tcp_sock_alloc()
   mbuf_queue_init(&ts->ofo_queue);
   mbuf_queue_init(&ts->rcv_queue);
   mbuf_queue_init(&ts->write_queue);
+  mbuf_queue_init(&ts->snd_queue);
 
   initlock(&ts->spinlk, "tcp sock lock");
+  pollhead_init(&ts->ph);
 
-  acquire(&tcpsocks_list_lk);
-  list_add(&ts->tcpsock_list, &tcpsocks_list_head);
-  release(&tcpsocks_list_lk);
-  
   return ts;
 }
 
@@ -52,7 +63,7 @@ tcp_bind(struct file *f, struct sockaddr *addr, int addrlen)
 
   struct sockaddr_in *sin = (struct sockaddr_in *)addr;
   
-  if (sin->sin_port >= MAX_PORT_N)
+  if (sin->sin_port >= MAX_PORT_N || f->tcpsock->sport)
     return -1;
   
   int r = alloc_port(f, sin->sin_port);
@@ -64,10 +75,28 @@ int
 tcp_connect(struct file *f, struct sockaddr *addr, int addrlen, int port)
 {
   struct tcp_sock *ts = f->tcpsock;
+  int err;
+
   acquire(&ts->spinlk);
-  if (ts->state != TCP_CLOSE) {
+  switch (ts->state) {
+  case TCP_CLOSE:
+    break;
+  case TCP_SYN_SENT:
+    release(&ts->spinlk);
+    return -EALREADY;
+  case TCP_LISTEN:
     release(&ts->spinlk);
     return -1;
+  default:
+    release(&ts->spinlk);
+    return -EISCONN;
+  }
+  /* an earlier non-blocking connect() failed, report why */
+  if (ts->err) {
+    err = ts->err;
+    ts->err = 0;
+    release(&ts->spinlk);
+    return -err;
   }
 
   struct sockaddr_in *sin = (struct sockaddr_in *)addr;
@@ -80,14 +109,26 @@ tcp_connect(struct file *f, struct sockaddr *addr, int addrlen, int port)
   ts->tcb.iss = alloc_new_iss();
   ts->tcb.snd_una = ts->tcb.iss;
   ts->tcb.snd_nxt = ts->tcb.iss + 1;
+  tcp_hash_established(ts);
 
   tcp_send_syn(ts);
 
+  /*
+   * Without waiting, poll() reports POLLOUT once the connection is
+   * established, or POLLERR if it failed; connect() then says why.
+   */
+  if (f->nonblock) {
+    release(&ts->spinlk);
+    return -EINPROGRESS;
+  }
+
   sleep(&ts->wait_connect, &ts->spinlk);
   if (ts->state != TCP_ESTABLISHED) {
+    err = ts->err ? ts->err : ECONNREFUSED;
+    ts->err = 0;
     release(&ts->spinlk);
     tcp_set_state(ts, TCP_CLOSE);
-    return -1;
+    return -err;
   }
   tcpdbg("TCP CLIENT ESTABLISHED SUCCESS, sport: %d\n", port);
 
@@ -105,6 +146,8 @@ tcp_listen(struct file *f, int backlog)
     release(&ts->spinlk);
     return -1;
   }
+  if (backlog < 1)
+    backlog = 1;
     
   if (ts->state != TCP_CLOSE || !ts->sport) {
     release(&ts->spinlk);
@@ -113,6 +156,7 @@ tcp_listen(struct file *f, int backlog)
     
   ts->state = TCP_LISTEN;
   ts->backlog = backlog;
+  tcp_hash_listen(ts);
 
   release(&ts->spinlk);
 
@@ -130,21 +174,75 @@ tcp_accept_dequeue(struct tcp_sock *ts)
 }
 
 
-struct tcp_sock *
-tcp_accept(struct file *f)
+// Takes the next established connection off the listener f.
+// Returns -EAGAIN if none is waiting and f is non-blocking.
+int
+tcp_accept(struct file *f, struct tcp_sock **newts)
 {
   struct tcp_sock *ts = f->tcpsock;
   acquire(&ts->spinlk);
+  if (ts->state != TCP_LISTEN) {
+    release(&ts->spinlk);
+    return -1;
+  }
 
   while (list_empty(&ts->accept_queue)) {
+    if (f->nonblock) {
+      release(&ts->spinlk);
+      return -EAGAIN;
+    }
+    if (myproc()->killed) {
+      release(&ts->spinlk);
+      return -1;
+    }
     sleep(&ts->wait_accept, &ts->spinlk);
   }
 
-  struct tcp_sock *newts = tcp_accept_dequeue(ts);
+  *newts = tcp_accept_dequeue(ts);
 
   release(&ts->spinlk);
 
-  return newts;
+  return 0;
+}
+
+// A listener is readable when a connection is waiting for
+// accept(). A connection is readable when data or the peer's
+// FIN has arrived, and writable when the send buffer has room.
+int
+tcp_poll(struct file *f, struct pollhead **ph)
+{
+  struct tcp_sock *ts = f->tcpsock;
+  int mask = 0;
+
+  if (ph)
+    *ph = ts ? &ts->ph : 0;
+  if (!ts)
+    return POLLERR;
+
+  acquire(&ts->spinlk);
+  switch (ts->state) {
+  case TCP_LISTEN:
+    if (!list_empty(&ts->accept_queue))
+      mask |= POLLIN;
+    break;
+  case TCP_SYN_SENT:
+  case TCP_SYN_RECEIVED:
+    break;
+  case TCP_CLOSE:
+    mask |= POLLIN | POLLHUP;
+    if (ts->err)
+      mask |= POLLERR;
+    break;
+  default:
+    if (!mbuf_queue_empty(&ts->rcv_queue) || (ts->flags & TCP_FIN))
+      mask |= POLLIN;
+    if ((ts->state == TCP_ESTABLISHED || ts->state == TCP_CLOSE_WAIT) &&
+        tcp_sndbuf_space(ts) > 0)
+      mask |= POLLOUT;
+    break;
+  }
+  release(&ts->spinlk);
+  return mask;
 }
 
 int
@@ -174,7 +272,7 @@ tcp_read(struct file *f, uint64 addr, int n)
     break;
   }
 
-  rlen = tcp_receive(ts, addr, n);
+  rlen = tcp_receive(ts, addr, n, f->nonblock);
   release(&ts->spinlk);
 
   return rlen;
@@ -196,12 +294,99 @@ tcp_write(struct file *f, uint64 ubuf, int len)
       return -1;
   }
 
-  int rc = tcp_send(ts, ubuf, len);
+  int rc = tcp_send(ts, ubuf, len, f->nonblock);
   release(&ts->spinlk);
 
   return rc;
 }
 
+// Sends count bytes of the file ip from offset off. Each segment
+// is read from the buffer cache straight into an mbuf, without a
+// trip through user memory. The socket lock is dropped while the
+// file is read, since reading may sleep on the disk. Returns 0 at
+// the end of the file; a non-blocking socket without buffer space
+// returns what was queued so far, or -EAGAIN.
+int
+tcp_sendfile(struct file *f, struct inode *ip, uint off, int count)
+{
+  struct tcp_sock *ts = f->tcpsock;
+  struct mbuf *m;
+  int sent = 0;
+  int n, r = 0;
+
+  if (!ts) return -1;
+
+  while (sent < count) {
+    n = count - sent;
+    if (n > ts->mss)
+      n = ts->mss;
+
+    m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+    if (!m) {
+      r = -1;
+      break;
+    }
+    ilock(ip);
+    r = readi(ip, 0, (uint64)mbufput(m, n), off + sent, n);
+    iunlock(ip);
+    if (r <= 0) {
+      /* 0 is the end of the file, not an error */
+      mbuffree(m);
+      r = r < 0 ? -1 : 0;
+      break;
+    }
+    mbuftrim(m, n - r);
+
+    acquire(&ts->spinlk);
+    r = tcp_send_mbuf(ts, m, f->nonblock);
+    release(&ts->spinlk);
+    if (r < 0)
+      break;
+    sent += r;
+  }
+
+  /* report what was queued before an error or a full buffer */
+  if (sent == 0 && r < 0)
+    return r;
+  return sent;
+}
+
+int
+tcp_setsockopt(struct file *f, int level, int optname, int val)
+{
+  struct tcp_sock *ts = f->tcpsock;
+  int r = 0;
+
+  acquire(&ts->spinlk);
+  if (level == SOL_SOCKET) {
+    /* only before bind(), the port is shared or not from then on */
+    if (optname == SO_REUSEPORT && !ts->sport)
+      ts->reuseport = val != 0;
+    else
+      r = -1;
+    release(&ts->spinlk);
+    return r;
+  }
+
+  switch (optname) {
+    case TCP_NODELAY:
+      ts->nodelay = val != 0;
+      break;
+    case TCP_CORK:
+      ts->cork = val != 0;
+      break;
+    default:
+      r = -1;
+      break;
+  }
+  /* send what the old setting held back */
+  if (!r && (ts->state == TCP_ESTABLISHED || ts->state == TCP_CLOSE_WAIT))
+    tcp_push(ts);
+  release(&ts->spinlk);
+
+  return r;
+}
+
 static void
 tcp_clear_listen_queue(struct tcp_sock *ts)
 {
@@ -233,17 +418,16 @@ tcp_close(struct file *f)
       return 0;
     case TCP_SYN_RECEIVED:
     case TCP_SYN_SENT:
+      release(&ts->spinlk);
       tcp_done(ts);
-      break;
+      return 0;
     case TCP_ESTABLISHED:
       ts->state = TCP_FIN_WAIT_1;
       tcp_send_fin(ts);
-      ts->tcb.snd_nxt++;
       break;
     case TCP_CLOSE_WAIT:
       ts->state = TCP_LAST_ACK;
       tcp_send_fin(ts);
-      ts->tcb.snd_nxt++;
       // tcpdbg("after send FIN, snd_nxt: %d\n", ts->tcb.snd_nxt);
       break;
   }
@@ -0,0 +1,157 @@
+//
+// SYN cookies. When a listener's SYN queue is full, the connection
+// is encoded in the ISS of the SYN-ACK instead of in a child socket,
+// and rebuilt from the ACK that completes the handshake.
+//
+// cookie = counter (8 bits) | hash (22 bits) | MSS index (2 bits)
+//
+// The hash covers the 4-tuple, the peer's ISN and the counter, which
+// steps every COOKIE_PERIOD ticks. Window scaling and SACK do not fit
+// in a cookie, so such connections go without them.
+//
+// The hash is keyed with a secret that changes with the counter. It
+// is drawn from a pool stirred with the time CSR at the arrival of
+// every SYN to a listener, so it cannot be guessed from the uptime
+// or the address of the host.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "list.h"
+#include "mbuf.h"
+#include "net.h"
+#include "defs.h"
+#include "debug.h"
+#include "pollwait.h"
+#include "tcp.h"
+
+#define COOKIE_PERIOD 600 /* 60sec */
+#define COOKIE_MAXAGE 2   /* counter steps a cookie stays valid */
+#define COOKIE_NSECRET 4  /* secrets kept, more than COOKIE_MAXAGE */
+
+static uint16 cookie_mss[] = { 536, 1220, 1440, 1460 };
+
+static struct spinlock cookie_lock;
+static uint32 cookie_pool; // stirred by tcp_syncookie_stir()
+static struct {
+  uint32 count;  // counter value the secret was made for
+  uint32 secret;
+  int valid;
+} cookie_secrets[COOKIE_NSECRET];
+
+static _inline uint32
+cookie_mix(uint32 h, uint32 w)
+{
+  h ^= w;
+  h *= 0x9e3779b1;
+  h ^= h >> 15;
+  return h;
+}
+
+void
+tcp_syncookie_init(void)
+{
+  initlock(&cookie_lock, "syncookie");
+  cookie_pool = cookie_mix(0, (uint32)r_time());
+}
+
+// Mixes the arrival time of a SYN with ISN isn into the pool that
+// secrets are drawn from.
+void
+tcp_syncookie_stir(uint32 isn)
+{
+  uint64 t = r_time();
+
+  acquire(&cookie_lock);
+  cookie_pool = cookie_mix(cookie_pool, (uint32)t);
+  cookie_pool = cookie_mix(cookie_pool, (uint32)(t >> 32) ^ isn);
+  release(&cookie_lock);
+}
+
+// Returns the secret for counter value count, making it if make is
+// set and none is there yet. Sets *ok to 0 if there is none.
+static uint32
+cookie_secret(uint32 count, int make, int *ok)
+{
+  uint32 secret;
+  int i = count % COOKIE_NSECRET;
+
+  acquire(&cookie_lock);
+  if (!cookie_secrets[i].valid || cookie_secrets[i].count != count) {
+    if (!make) {
+      release(&cookie_lock);
+      *ok = 0;
+      return 0;
+    }
+    cookie_pool = cookie_mix(cookie_pool, (uint32)r_time());
+    cookie_secrets[i].secret = cookie_mix(cookie_pool, count);
+    cookie_secrets[i].count = count;
+    cookie_secrets[i].valid = 1;
+  }
+  secret = cookie_secrets[i].secret;
+  release(&cookie_lock);
+  *ok = 1;
+  return secret;
+}
+
+static uint32
+cookie_hash(uint32 secret, uint32 laddr, uint32 raddr, uint16 lport,
+            uint16 rport, uint32 isn, uint32 count)
+{
+  uint32 w[] = { laddr, raddr, (uint32)lport << 16 | rport, isn, count };
+  uint32 h = secret;
+  int i;
+
+  for (i = 0; i < NELEM(w); i++)
+    h = cookie_mix(h, w[i]);
+  return h;
+}
+
+// Makes the ISS of a SYN-ACK answering a SYN with ISN isn. *mss is
+// the peer's MSS, rounded down to what the cookie can carry.
+uint32
+tcp_syncookie_make(uint32 laddr, uint32 raddr, uint16 lport, uint16 rport,
+                   uint32 isn, uint16 *mss)
+{
+  uint32 count = ticks / COOKIE_PERIOD;
+  uint32 secret;
+  int i, ok;
+
+  secret = cookie_secret(count, 1, &ok);
+
+  for (i = NELEM(cookie_mss) - 1; i > 0 && cookie_mss[i] > *mss; i--)
+    ;
+  *mss = cookie_mss[i];
+
+  return (count & 0xff) << 24 |
+         (cookie_hash(secret, laddr, raddr, lport, rport, isn, count) & 0x3fffff) << 2 |
+         i;
+}
+
+// Returns the MSS carried by cookie, or 0 if it is not valid for
+// this connection.
+uint16
+tcp_syncookie_check(uint32 laddr, uint32 raddr, uint16 lport, uint16 rport,
+                    uint32 isn, uint32 cookie)
+{
+  uint32 now = ticks / COOKIE_PERIOD;
+  uint32 age = (now - (cookie >> 24)) & 0xff;
+  uint32 secret;
+  int ok;
+
+  if (age > COOKIE_MAXAGE)
+    return 0;
+  secret = cookie_secret(now - age, 0, &ok);
+  if (!ok)
+    return 0;
+  if (((cookie >> 2) & 0x3fffff) !=
+      (cookie_hash(secret, laddr, raddr, lport, rport, isn, now - age) & 0x3fffff))
+    return 0;
+
+  return cookie_mss[cookie & 3];
+}
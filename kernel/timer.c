@@ -10,41 +10,55 @@
 #include "net.h"
 #include "defs.h"
 #include "debug.h"
+#include "pollwait.h"
 #include "tcp.h"
 #include "timer.h"
 
 extern uint ticks;
 
 LIST_HEAD(timers);
-LIST_HEAD(waitadds);
 struct spinlock timerslk;
+static struct kmem_cache *timer_cache;
 
 void timer_init()
 {
   list_init(&timers);
   initlock(&timerslk, "timerslk");
+  timer_cache = kmem_cache_create("timer", sizeof(struct timer), 0);
+}
 
-  list_init(&waitadds);
+static void
+timer_put(struct timer *t)
+{
+  if (t->expired && t->refcnt <= 0)
+    kmem_cache_free(timer_cache, t);
 }
 
+// The returned timer holds one reference for the caller, which
+// must be dropped with timer_release() or timer_cancel().
 struct timer *
 timer_add(uint32 expire, void *(*handler)(void *), void *arg)
 {
 #ifdef TIMER_DEBUG
   printf("timer add...\n");
 #endif
-  struct timer *t = (struct timer *)kalloc();
+  struct timer *t = kmem_cache_alloc(timer_cache);
+  if (!t)
+    return NULL;
   t->expires = ticks + expire;
 
   if (t->expires < ticks)
   {
-    kfree(t);
+    kmem_cache_free(timer_cache, t);
     return NULL;
   }
 
   t->handler = handler;
   t->arg = arg;
   t->cancelled = 0;
+  t->fired = 0;
+  t->expired = 0;
+  t->refcnt = 1;
 
   acquire(&timerslk);
   list_add_tail(&t->list, &timers);
@@ -53,49 +67,73 @@ timer_add(uint32 expire, void *(*handler)(void *), void *arg)
   return t;
 }
 
+// Fire-and-forget timer. Handlers run without timerslk held,
+// so this is also safe to call from inside a handler.
 void
 timer_add_in_handler(uint32 expire, void *(*handler)(void *), void *arg)
 {
-  struct timer *t = (struct timer *)kalloc();
-  t->expires = ticks + expire;
-
-  if (t->expires < ticks)
-  {
-    kfree(t);
-    return;
-  }
-
-  t->handler = handler;
-  t->arg = arg;
-  t->cancelled = 0;
+  struct timer *t = timer_add(expire, handler, arg);
+  if (t)
+    timer_release(t);
+}
 
-  list_add_tail(&t->waitadd, &waitadds);
+void timer_release(struct timer *t)
+{
+  acquire(&timerslk);
+  t->refcnt--;
+  timer_put(t);
+  release(&timerslk);
 }
 
-void timer_cancel(struct timer *t)
+// Returns 1 if the handler will not run, 0 if it has already been
+// started, in which case it may still be running on another CPU.
+int timer_cancel(struct timer *t)
 {
+  int r;
+
+  acquire(&timerslk);
   t->cancelled = 1;
+  r = !t->fired;
+  t->refcnt--;
+  timer_put(t);
+  release(&timerslk);
+  return r;
 }
 
 void timers_exe_all()
 {
-  acquire(&timerslk);
+  struct list_head expired;
   struct timer *t, *nt;
+
+  list_init(&expired);
+
+  acquire(&timerslk);
   list_for_each_entry_safe(t, nt, &timers, list)
   {
-    if (t->expires <= ticks) {
-      if (!t->cancelled)
-        t->handler(t->arg);
+    if (t->cancelled || t->expires <= ticks) {
       list_del(&t->list);
-      kfree(t);
+      list_add_tail(&t->list, &expired);
     }
   }
+  release(&timerslk);
 
-  while (!list_empty(&waitadds)) {
-    struct timer *t = list_first_entry(&waitadds, struct timer, waitadd);
-    list_del(&t->waitadd);
-    list_add_tail(&t->list, &timers);
+  // Handlers run without timerslk, so they may take socket locks
+  // while other CPUs holding those locks add or cancel timers.
+  list_for_each_entry(t, &expired, list)
+  {
+    acquire(&timerslk);
+    t->fired = !t->cancelled;
+    release(&timerslk);
+    if (t->fired)
+      t->handler(t->arg);
   }
 
+  acquire(&timerslk);
+  while (!list_empty(&expired)) {
+    t = list_first_entry(&expired, struct timer, list);
+    list_del(&t->list);
+    t->expired = 1;
+    timer_put(t);
+  }
   release(&timerslk);
 }
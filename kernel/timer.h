@@ -1,10 +1,11 @@
-
 struct timer
 {
   struct list_head list;
-  struct list_head waitadd;
   uint32 expires;
   int cancelled;
+  int fired;    // the handler has been started, cancelling cannot stop it
+  int expired;  // off the timers list, may be freed once refcnt drops to 0
+  int refcnt;   // references held by the owner of the timer
   void *(*handler)(void *);
   void *arg;
-};
\ No newline at end of file
+};
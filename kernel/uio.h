@@ -0,0 +1,5 @@
+// A piece of kernel memory, one of several copied out together.
+struct iovec {
+  void *iov_base;
+  uint64 iov_len;
+};
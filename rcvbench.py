@@ -0,0 +1,23 @@
+import socket
+import sys
+import time
+
+# Sends the same amount of data over one connection per read size
+# tested by user/rcvbench.c.
+port = int(sys.argv[1])
+total = int(sys.argv[2]) if len(sys.argv) > 2 else 4 * 1024 * 1024
+nsizes = 5
+
+chunk = b'x' * 65536
+for i in range(nsizes):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(('127.0.0.1', port))
+    left = total
+    while left > 0:
+        n = min(left, len(chunk))
+        s.sendall(chunk[:n])
+        left -= n
+    s.close()
+    print('sent %d bytes' % total, file=sys.stderr)
+    # let rcvbench print and accept the next connection
+    time.sleep(1)
@@ -1,13 +1,46 @@
 import socket
 import sys
+import threading
+import time
+
+# echoes a TCP connection back until the guest closes it
+def echo(conn):
+    with conn:
+        while True:
+            buf = conn.recv(4096)
+            if not buf:
+                break
+            conn.sendall(buf)
+
+def tcp_echo(addr):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(addr)
+    s.listen(16)
+    while True:
+        conn, raddr = s.accept()
+        threading.Thread(target=echo, args=(conn,), daemon=True).start()
+
+# opens n connections to the guest's TCP port, which qemu forwards,
+# and holds them open for a while
+def connect(port, n):
+    conns = [socket.create_connection(('localhost', port)) for i in range(n)]
+    time.sleep(5)
+    for c in conns:
+        c.close()
+
+tcpport = int(sys.argv[2]) if len(sys.argv) > 2 else 2222
 
 sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
 addr = ('localhost', int(sys.argv[1]))
 print('listening on %s port %s' % addr, file=sys.stderr)
 sock.bind(addr)
+threading.Thread(target=tcp_echo, args=(addr,), daemon=True).start()
 
 while True:
     buf, raddr = sock.recvfrom(4096)
     print(buf.decode("utf-8"), file=sys.stderr)
+    if buf == b'connect':
+        threading.Thread(target=connect, args=(tcpport, 4), daemon=True).start()
     if buf:
         sent = sock.sendto(b'this is the host!', raddr)
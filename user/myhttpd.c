@@ -177,14 +177,10 @@ send_header_fin(struct http_request *req)
 }
 
 static void
-send_data(struct http_request *req, int filefd)
+send_data(struct http_request *req, int filefd, int size)
 {
-    int n;
-    char buf[1024];
-    while ((n = read(filefd, buf, sizeof(buf))) > 0) {
-      if (write(req->fd, buf, n) != n)
-        die(req->fd, "Failed to send bytes to cline");
-    }
+    if (sendfile(req->fd, filefd, 0, size) != size)
+      die(req->fd, "Failed to send bytes to cline");
 }
 
 static int
@@ -218,11 +214,16 @@ send_file(struct http_request *req)
     close(filefd);
     return -1;
   } else if (st.type == T_FILE) {
+    /* send the header and the body in full-sized segments */
+    int on = 1, off = 0;
+    setsockopt(req->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
     send_header(req, 200);
     send_size(req, st.size);
     // send_content_type(req);
     send_header_fin(req);
-    send_data(req, filefd);
+    send_data(req, filefd, st.size);
+    setsockopt(req->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    close(filefd);
     printf("[%d] send file: %s\n", req->fd, filepath);
 
     return 0;
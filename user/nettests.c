@@ -1,6 +1,9 @@
 #include "kernel/types.h"
 #include "kernel/net.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/poll.h"
+#include "kernel/errno.h"
 #include "user/user.h"
 
 //
@@ -48,6 +51,460 @@ ping(uint16 sport, uint16 dport, int attempts)
   }
 }
 
+// 10.0.2.2:port, the host outside of qemu
+static void
+host_addr(struct sockaddr_in *sin, uint16 port)
+{
+  memset(sin, 0, sizeof(*sin));
+  sin->sin_family = AF_INET;
+  sin->sin_addr = htonl((10 << 24) | (0 << 16) | (2 << 8) | (2 << 0));
+  sin->sin_port = htons(port);
+}
+
+// binds a UDP socket to sport, fails the test if it cannot
+static int
+udp_socket(int type, uint16 sport)
+{
+  struct sockaddr_in sin;
+  int fd;
+
+  if((fd = socket(AF_INET, SOCK_DGRAM | type, 0)) < 0){
+    fprintf(2, "udp: socket() failed\n");
+    exit(1);
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(sport);
+  if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0){
+    fprintf(2, "udp: bind() failed\n");
+    exit(1);
+  }
+  return fd;
+}
+
+// connects a TCP socket to the echo server on the host,
+// fails the test if it cannot
+static int
+tcp_connect(uint16 dport)
+{
+  struct sockaddr_in sin;
+  int fd;
+
+  if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+    fprintf(2, "tcp: socket() failed\n");
+    exit(1);
+  }
+  host_addr(&sin, dport);
+  if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0){
+    fprintf(2, "tcp: connect() failed\n");
+    exit(1);
+  }
+  return fd;
+}
+
+// reads the echo of the n bytes at buf from fd, and checks it
+static void
+tcp_expect(int fd, char *buf, int n, char *what)
+{
+  char ibuf[512];
+  int cc, got = 0;
+
+  while(got < n){
+    cc = read(fd, ibuf, n - got > sizeof(ibuf) ? sizeof(ibuf) : n - got);
+    if(cc <= 0){
+      fprintf(2, "%s: read() failed\n", what);
+      exit(1);
+    }
+    if(memcmp(ibuf, buf + got, cc) != 0){
+      fprintf(2, "%s: wrong data echoed\n", what);
+      exit(1);
+    }
+    got += cc;
+  }
+}
+
+//
+// send a UDP packet with sendto() on an unbound socket, and
+// check the response and its source address from recvfrom().
+//
+static void
+udp_sendto(uint16 dport)
+{
+  struct sockaddr_in to, from;
+  char *obuf = "a message from xv6!";
+  char ibuf[128];
+  int fd, cc, fromlen;
+
+  if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
+    fprintf(2, "sendto: socket() failed\n");
+    exit(1);
+  }
+  host_addr(&to, dport);
+  if(sendto(fd, obuf, strlen(obuf), 0, (struct sockaddr *)&to, sizeof(to)) != strlen(obuf)){
+    fprintf(2, "sendto: sendto() failed\n");
+    exit(1);
+  }
+
+  fromlen = sizeof(struct sockaddr);
+  memset(&from, 0, sizeof(from));
+  cc = recvfrom(fd, ibuf, sizeof(ibuf)-1, 0, (struct sockaddr *)&from, &fromlen);
+  if(cc < 0){
+    fprintf(2, "sendto: recvfrom() failed\n");
+    exit(1);
+  }
+  ibuf[cc] = '\0';
+  if(strcmp(ibuf, "this is the host!") != 0){
+    fprintf(2, "sendto: wrong payload\n");
+    exit(1);
+  }
+  if(fromlen != sizeof(struct sockaddr) || from.sin_addr != to.sin_addr ||
+     from.sin_port != to.sin_port){
+    fprintf(2, "sendto: wrong source address\n");
+    exit(1);
+  }
+
+  // a short fromlen truncates the address, but reports its length
+  if(sendto(fd, obuf, strlen(obuf), 0, (struct sockaddr *)&to, sizeof(to)) < 0){
+    fprintf(2, "sendto: sendto() failed\n");
+    exit(1);
+  }
+  fromlen = 2;
+  memset(&from, 0xff, sizeof(from));
+  if(recvfrom(fd, ibuf, sizeof(ibuf)-1, 0, (struct sockaddr *)&from, &fromlen) < 0){
+    fprintf(2, "sendto: recvfrom() failed\n");
+    exit(1);
+  }
+  if(fromlen != sizeof(struct sockaddr) || from.sin_port != 0xffff){
+    fprintf(2, "sendto: recvfrom() ignored fromlen\n");
+    exit(1);
+  }
+
+  close(fd);
+}
+
+//
+// poll() on a socket nobody sends to must time out.
+//
+static void
+poll_timeout(void)
+{
+  struct pollfd pfd;
+  int fd, r, start;
+
+  fd = udp_socket(0, 3000);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  start = uptime();
+  if((r = poll(&pfd, 1, 300)) != 0){
+    fprintf(2, "poll: returned %d, not a timeout\n", r);
+    exit(1);
+  }
+  if(pfd.revents != 0 || uptime() - start < 2){
+    fprintf(2, "poll: timed out early\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+//
+// epoll_wait() reports a UDP socket readable once the reply from
+// the host arrives.
+//
+static void
+epoll(uint16 dport)
+{
+  struct epoll_event ev;
+  struct sockaddr_in to;
+  char *obuf = "a message from xv6!";
+  char ibuf[128];
+  int ep, fd;
+
+  fd = udp_socket(0, 3001);
+  if((ep = epoll_create()) < 0){
+    fprintf(2, "epoll: epoll_create() failed\n");
+    exit(1);
+  }
+  ev.events = EPOLLIN;
+  ev.data = 42;
+  if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0){
+    fprintf(2, "epoll: epoll_ctl() failed\n");
+    exit(1);
+  }
+  if(epoll_wait(ep, &ev, 1, 0) != 0){
+    fprintf(2, "epoll: ready before any data\n");
+    exit(1);
+  }
+
+  host_addr(&to, dport);
+  if(sendto(fd, obuf, strlen(obuf), 0, (struct sockaddr *)&to, sizeof(to)) < 0){
+    fprintf(2, "epoll: sendto() failed\n");
+    exit(1);
+  }
+  memset(&ev, 0, sizeof(ev));
+  if(epoll_wait(ep, &ev, 1, 5000) != 1 || !(ev.events & EPOLLIN) || ev.data != 42){
+    fprintf(2, "epoll: reply not reported\n");
+    exit(1);
+  }
+  if(read(fd, ibuf, sizeof(ibuf)) < 0){
+    fprintf(2, "epoll: read() failed\n");
+    exit(1);
+  }
+
+  close(ep);
+  close(fd);
+}
+
+//
+// reading an empty non-blocking socket fails with EAGAIN, and
+// fcntl() turns the flag on and off.
+//
+static void
+nonblock(void)
+{
+  char ibuf[16];
+  int fd, lfd, r;
+  struct sockaddr_in sin;
+
+  fd = udp_socket(SOCK_NONBLOCK, 3002);
+  if((r = read(fd, ibuf, sizeof(ibuf))) != -EAGAIN){
+    fprintf(2, "nonblock: read() returned %d, not -EAGAIN\n", r);
+    exit(1);
+  }
+  if((r = recvfrom(fd, ibuf, sizeof(ibuf), 0, 0, 0)) != -EAGAIN){
+    fprintf(2, "nonblock: recvfrom() returned %d, not -EAGAIN\n", r);
+    exit(1);
+  }
+  if(!(fcntl(fd, F_GETFL, 0) & O_NONBLOCK)){
+    fprintf(2, "nonblock: F_GETFL lost O_NONBLOCK\n");
+    exit(1);
+  }
+  close(fd);
+
+  // a listener made non-blocking by fcntl() has nothing to accept
+  if((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+    fprintf(2, "nonblock: socket() failed\n");
+    exit(1);
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(3003);
+  if(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(lfd, 4) < 0){
+    fprintf(2, "nonblock: bind() or listen() failed\n");
+    exit(1);
+  }
+  if(fcntl(lfd, F_SETFL, O_NONBLOCK) < 0 || !(fcntl(lfd, F_GETFL, 0) & O_NONBLOCK)){
+    fprintf(2, "nonblock: F_SETFL failed\n");
+    exit(1);
+  }
+  if((r = accept(lfd, 0, 0)) != -EAGAIN){
+    fprintf(2, "nonblock: accept() returned %d, not -EAGAIN\n", r);
+    exit(1);
+  }
+  close(lfd);
+}
+
+//
+// TCP listeners share a port only if they all set SO_REUSEPORT.
+//
+static void
+reuseport(void)
+{
+  struct sockaddr_in sin;
+  int fd[3], one = 1, i;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(3004);
+  for(i = 0; i < 3; i++){
+    if((fd[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+      fprintf(2, "reuseport: socket() failed\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < 2; i++){
+    if(setsockopt(fd[i], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+       bind(fd[i], (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+       listen(fd[i], 4) < 0){
+      fprintf(2, "reuseport: listener %d could not share the port\n", i);
+      exit(1);
+    }
+  }
+  if(bind(fd[2], (struct sockaddr *)&sin, sizeof(sin)) >= 0){
+    fprintf(2, "reuseport: bound without SO_REUSEPORT\n");
+    exit(1);
+  }
+  for(i = 0; i < 3; i++)
+    close(fd[i]);
+}
+
+//
+// small writes that Nagle coalesces come back intact, TCP_CORK
+// holds a partial segment until the socket is uncorked, and
+// TCP_NODELAY sends each write at once.
+//
+static void
+nagle(uint16 dport)
+{
+  struct pollfd pfd;
+  char obuf[100];
+  int fd, i, on = 1, off = 0;
+
+  for(i = 0; i < sizeof(obuf); i++)
+    obuf[i] = 'a' + i % 26;
+  fd = tcp_connect(dport);
+
+  // later writes wait while the first one is unacknowledged
+  for(i = 0; i < sizeof(obuf); i += 10){
+    if(write(fd, obuf + i, 10) != 10){
+      fprintf(2, "nagle: write() failed\n");
+      exit(1);
+    }
+  }
+  tcp_expect(fd, obuf, sizeof(obuf), "nagle");
+
+  if(setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0){
+    fprintf(2, "nagle: TCP_CORK failed\n");
+    exit(1);
+  }
+  if(write(fd, obuf, 10) != 10){
+    fprintf(2, "nagle: write() failed\n");
+    exit(1);
+  }
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if(poll(&pfd, 1, 500) != 0){
+    fprintf(2, "nagle: TCP_CORK sent a partial segment\n");
+    exit(1);
+  }
+  if(setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) < 0){
+    fprintf(2, "nagle: uncorking failed\n");
+    exit(1);
+  }
+  tcp_expect(fd, obuf, 10, "nagle");
+
+  if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0){
+    fprintf(2, "nagle: TCP_NODELAY failed\n");
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    if(write(fd, obuf + i, 1) != 1){
+      fprintf(2, "nagle: write() failed\n");
+      exit(1);
+    }
+    tcp_expect(fd, obuf + i, 1, "nagle");
+  }
+  if(setsockopt(fd, IPPROTO_TCP, 99, &on, sizeof(on)) >= 0){
+    fprintf(2, "nagle: unknown option accepted\n");
+    exit(1);
+  }
+
+  close(fd);
+}
+
+//
+// a listener queues at most backlog connections for accept().
+// server.py opens four to the port qemu forwards to the guest.
+//
+static void
+backlog(uint16 dport)
+{
+  struct sockaddr_in sin;
+  struct pollfd pfd;
+  char *obuf = "connect";
+  char ibuf[128];
+  int lfd, ufd, fd[4], n, i;
+
+  if((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+    fprintf(2, "backlog: socket() failed\n");
+    exit(1);
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(NET_TESTS_TCPPORT);
+  if(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(lfd, 2) < 0){
+    fprintf(2, "backlog: bind() or listen() failed\n");
+    exit(1);
+  }
+
+  ufd = udp_socket(0, 3005);
+  host_addr(&sin, dport);
+  if(sendto(ufd, obuf, strlen(obuf), 0, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+     read(ufd, ibuf, sizeof(ibuf)) < 0){
+    fprintf(2, "backlog: server.py did not answer\n");
+    exit(1);
+  }
+  close(ufd);
+
+  // let the handshakes, and retransmitted SYNs, come in
+  sleep(20);
+
+  pfd.fd = lfd;
+  pfd.events = POLLIN;
+  for(n = 0; n < 4; n++){
+    pfd.revents = 0;
+    if(poll(&pfd, 1, 0) != 1)
+      break;
+    if((fd[n] = accept(lfd, 0, 0)) < 0){
+      fprintf(2, "backlog: accept() failed\n");
+      exit(1);
+    }
+  }
+  if(n == 0 || n > 2){
+    fprintf(2, "backlog: %d connections queued, backlog is 2\n", n);
+    exit(1);
+  }
+
+  for(i = 0; i < n; i++)
+    close(fd[i]);
+  close(lfd);
+}
+
+//
+// sendfile() sends a file, or part of it, to a TCP socket, and
+// returns 0 at the end of the file.
+//
+static void
+sendfile_test(uint16 dport)
+{
+  static char fbuf[3000];
+  int fd, sfd, i;
+
+  for(i = 0; i < sizeof(fbuf); i++)
+    fbuf[i] = 'A' + i % 23;
+  if((fd = open("sendfile.tmp", O_CREATE | O_RDWR)) < 0 ||
+     write(fd, fbuf, sizeof(fbuf)) != sizeof(fbuf)){
+    fprintf(2, "sendfile: cannot write sendfile.tmp\n");
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("sendfile.tmp", O_RDONLY)) < 0){
+    fprintf(2, "sendfile: cannot open sendfile.tmp\n");
+    exit(1);
+  }
+  sfd = tcp_connect(dport);
+  if(sendfile(sfd, fd, 0, sizeof(fbuf)) != sizeof(fbuf)){
+    fprintf(2, "sendfile: short sendfile()\n");
+    exit(1);
+  }
+  tcp_expect(sfd, fbuf, sizeof(fbuf), "sendfile");
+  if(sendfile(sfd, fd, 1000, 500) != 500){
+    fprintf(2, "sendfile: short sendfile() at an offset\n");
+    exit(1);
+  }
+  tcp_expect(sfd, fbuf + 1000, 500, "sendfile");
+  if(sendfile(sfd, fd, sizeof(fbuf), 100) != 0){
+    fprintf(2, "sendfile: sendfile() at EOF did not return 0\n");
+    exit(1);
+  }
+
+  close(sfd);
+  close(fd);
+  unlink("sendfile.tmp");
+}
+
 // Encode a DNS name
 static void
 encode_qname(char *qn, char *host)
@@ -252,6 +709,38 @@ main(int argc, char *argv[])
       exit(1);
   }
   printf("OK\n");
+
+  printf("testing UDP sendto/recvfrom: ");
+  udp_sendto(dport);
+  printf("OK\n");
+
+  printf("testing poll timeout: ");
+  poll_timeout();
+  printf("OK\n");
+
+  printf("testing epoll: ");
+  epoll(dport);
+  printf("OK\n");
+
+  printf("testing non-blocking sockets: ");
+  nonblock();
+  printf("OK\n");
+
+  printf("testing SO_REUSEPORT: ");
+  reuseport();
+  printf("OK\n");
+
+  printf("testing Nagle and TCP_NODELAY: ");
+  nagle(dport);
+  printf("OK\n");
+
+  printf("testing listen backlog: ");
+  backlog(dport);
+  printf("OK\n");
+
+  printf("testing sendfile: ");
+  sendfile_test(dport);
+  printf("OK\n");
   
   printf("testing DNS\n");
   dns();
@@ -0,0 +1,74 @@
+//
+// Receive throughput against read size.
+// Run rcvbench in xv6, then `make rcvbench` on the host, which
+// connects once per read size and sends the same amount of data
+// each time.
+//
+
+#include "kernel/types.h"
+#include "kernel/net.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define PORT 2222
+#define MAXREAD 16384
+
+int sizes[] = {64, 256, 1024, 4096, MAXREAD};
+
+// Reads the connection fd to the end with reads of size n.
+static void
+drain(int fd, char *buf, int n)
+{
+  int r, total = 0;
+  int start, ticks;
+
+  start = uptime();
+  while ((r = read(fd, buf, n)) > 0)
+    total += r;
+  ticks = uptime() - start;
+  if (ticks == 0)
+    ticks = 1;
+
+  // a tick is 100ms
+  printf("read %d: %d bytes in %d ticks, %d KB/s\n",
+         n, total, ticks, total / ticks * 10 / 1024);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct sockaddr_in addr;
+  struct sockaddr clientsa;
+  int fd, clientfd, salen, i;
+  char *buf;
+
+  if ((buf = malloc(MAXREAD)) == 0) {
+    printf("rcvbench: out of memory\n");
+    exit(1);
+  }
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    printf("rcvbench: socket error\n");
+    exit(1);
+  }
+  addr.sin_family = AF_INET;
+  addr.sin_addr = INADDR_ANY;
+  addr.sin_port = htons(PORT);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 5) < 0) {
+    printf("rcvbench: cannot listen on %d\n", PORT);
+    exit(1);
+  }
+
+  printf("rcvbench: listening on %d\n", PORT);
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if ((clientfd = accept(fd, &clientsa, &salen)) < 0) {
+      printf("rcvbench: accept error\n");
+      exit(1);
+    }
+    drain(clientfd, buf, sizes[i]);
+    close(clientfd);
+  }
+
+  close(fd);
+  exit(0);
+}
@@ -2,6 +2,8 @@ struct stat;
 struct rtcdate;
 struct sysinfo;
 struct sockaddr;
+struct pollfd;
+struct epoll_event;
 
 // system calls
 int fork(void);
@@ -31,6 +33,15 @@ int bind(int, struct sockaddr*, int);
 int listen(int, int);
 int accept(int, struct sockaddr*, int*);
 int connect(int, struct sockaddr*, int);
+int setsockopt(int, int, int, void*, int);
+int recvfrom(int, void*, int, int, struct sockaddr*, int*);
+int sendto(int, const void*, int, int, struct sockaddr*, int);
+int sendfile(int, int, int, int);
+int poll(struct pollfd*, int, int);
+int epoll_create(void);
+int epoll_ctl(int, int, int, struct epoll_event*);
+int epoll_wait(int, struct epoll_event*, int, int);
+int fcntl(int, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
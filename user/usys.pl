@@ -42,3 +42,12 @@ entry("bind");
 entry("listen");
 entry("accept");
 entry("connect");
+entry("setsockopt");
+entry("recvfrom");
+entry("sendto");
+entry("sendfile");
+entry("poll");
+entry("epoll_create");
+entry("epoll_ctl");
+entry("epoll_wait");
+entry("fcntl");